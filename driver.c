@@ -12,12 +12,19 @@
 #include <jack/jack.h>
 #include <linux/input.h>
 #include <linux/limits.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -34,23 +41,88 @@ char home_dir[PATH_MAX + 1];
 struct jack_connection;
 struct pedal_config;
 
+// The port mod-host listens for commands on.  See
+// `patch-mod-host.service`
+#define MOD_HOST_PORT 5555
+
 void Log(char * sp, ...);
 int load_pedal(char);
 void print_pedal(char pedal);
 void clear_jack();
 void initialise_pedals();
 void destroy_pedals();
+void free_pedal_config(struct pedal_config * pc);
 int connected(const char * port_a, const char * port_b);
 void free_connection(struct jack_connection  * jc);
 void print_connections();
 void clean_cfg(const struct pedal_config * pc_in, struct pedal_config * pc_ret);
+void initialise_controls();
+void destroy_controls();
+uint64_t now_usec();
+void journal_param(unsigned instance, const char * symbol, float value);
+void journal_pedal(char pedal);
+void journal_links();
+struct mod_host;
+struct mod_host * mod_host_on(int port);
+struct mod_host * mod_host_for(unsigned instance);
+int change_pedal(char * old_pedal, char * new_pedal);
+void trace_switch(char * old_pedal, char * new_pedal);
+void trace_switch_done(int result, uint64_t usec);
+void trace_jack(int op, int result, uint64_t start, const char * src,
+		const char * dst);
+void trace_config(char pedal, const char * src, const char * dst);
+void trace_reload();
+void trace_reload_pedal(char pedal);
+void trace_reconnect(char pedal, int connected);
+int reconnect_pedal(char p, char * current_pedal, struct pedal_config * old,
+		    int connect);
+int idle_asleep(unsigned instance);
+void trace_mod_host(const char * cmd);
+void trace_mod_host_resp(int status);
+
+// The calls to JACK that are traced.  See "Trace" below
+enum trace_op {
+  TRACE_OP_DISCONNECT = 0,
+  TRACE_OP_CONNECT = 1,
+  TRACE_OP_CONNECTED = 2, // jack_port_connected_to
+};
 
 struct jack_connection {
   char * ports[2];
 };
+
+// A parameter value set by a pedal file
+struct pedal_param {
+  char symbol[64];
+  float value;
+};
+
+// An effect a pedal file declares it uses: `add <uri> <instance>`
+// and `param_set <instance> <symbol> <value>` lines.  See `reconcile`
+struct pedal_effect {
+  unsigned instance;
+  char * uri;
+  int port; // Of the mod-host it is in
+  struct pedal_param * params;
+  unsigned n_params;
+};
+
 struct pedal_config {
   struct jack_connection * connections;
   unsigned n_connections;
+
+  // `jack <src> <dst>` lines: Connections between effects that are
+  // made when the effects are set up (see `reconcile`), not when the
+  // pedal is selected.  The switch engine leaves them alone
+  struct jack_connection * internal;
+  unsigned n_internal;
+
+  struct pedal_effect * effects;
+  unsigned n_effects;
+
+  // Set by a `mod-host <port>` line.  Effects added after it are in
+  // that mod-host.  0 for MOD_HOST_PORT
+  int mod_host_port;
 };
 
 struct Pedals {
@@ -60,6 +132,12 @@ struct Pedals {
 };
 struct Pedals pedals;
 
+// The effects declared by every board file in PEDALS, not only the
+// three linked as A, B, and C.  Reconcile keeps them all in mod-host,
+// so changing the bank does not unload anything.  Only `effects` (and
+// `mod_host_port` while loading) are used
+struct pedal_config boards;
+
 
 struct pedal_config * get_pedal_config(const char c) {
 
@@ -82,21 +160,58 @@ struct pedal_config * get_pedal_config(const char c) {
   return pc;
 }  
 
+// Does pedal config `pc` have the connection `src` -> `dst`?
+int pedal_has(const struct pedal_config * pc, const char * src,
+	      const char * dst){
+  for(unsigned i = 0; i < pc->n_connections; i++){
+    if(pc->connections[i].ports[0] && pc->connections[i].ports[1] &&
+       !strcmp(pc->connections[i].ports[0], src) &&
+       !strcmp(pc->connections[i].ports[1], dst)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The number of effects declared by all the pedal and board files
+unsigned declared_effects(){
+  return pedals.pedal_configA.n_effects + pedals.pedal_configB.n_effects +
+    pedals.pedal_configC.n_effects + boards.n_effects;
+}
+
+// The effect the pedal files, or failing them the board files,
+// declare as `instance`, or NULL
+struct pedal_effect * declared_effect(unsigned instance){
+  struct pedal_config * pcs[4] = {&pedals.pedal_configA,
+				  &pedals.pedal_configB,
+				  &pedals.pedal_configC, &boards};
+  for(unsigned c = 0; c < 4; c++){
+    struct pedal_config * pc = pcs[c];
+    for(unsigned i = 0; i < pc->n_effects; i++){
+      if(pc->effects[i].instance == instance){
+	return &pc->effects[i];
+      }
+    }
+  }
+  return NULL;
+}
+
 /*
   Make the jack connections (from the system input to effect, from
   effect to system output) that enables an effect. This is done
   before the old connections for the pedal being replaced is
   disconnected/deimplemented.
 
+  Returns 0 on success or -1 if a connection could not be made
 */
-void implement_pedal(char * pedal){
+int implement_pedal(char * pedal){
 #ifdef VERBOSE
   Log( "%s:%d implement_pedal %c\n",
        __FILE__, __LINE__, *pedal);
 #endif
   if ( pedal == NULL ) {
     // TODO Is this possible? Should this be a crash?
-    return;
+    return 0;
   }
   
   // Get the configuration data for the old and new pedal
@@ -108,7 +223,9 @@ void implement_pedal(char * pedal){
     char * dst_port = pc->connections[i].ports[1];
     int r = 0;
     if(!connected(src_port, dst_port)){
+      uint64_t t = now_usec();
       r = jack_connect(CLIENT, src_port, dst_port);
+      trace_jack(TRACE_OP_CONNECT, r, t, src_port, dst_port);
     }else{
 #ifdef VERBOSE
       Log( "%s:%d src_port: %s dst_port %s already connected\n",
@@ -123,8 +240,8 @@ void implement_pedal(char * pedal){
 #ifdef VERBOSE
 	print_connections();
 #endif
-	// Bail out after an error
-	exit(-1);
+	// The caller bails out after an error
+	return -1;
       }
     }
   }
@@ -132,19 +249,21 @@ void implement_pedal(char * pedal){
   Log( "%s:%d END implement_pedal %c\n",
        __FILE__, __LINE__,  *pedal);
 #endif
+  return 0;
 }
 
 
 // Disconnect the jack pipes that lead into this pedal.  `pedal` is
 // the old pedal being disconnected.  `new_pedal` is the pedal that
 // has replaced it.  Before connecting anything from `pedal` ensure
-// `new_pedal` does not need it too.
-void deimplement_pedal(char * pedal, char * new_pedal){
+// `new_pedal` does not need it too.  Returns 0 on success or -1 if
+// a connection could not be broken
+int deimplement_pedal(char * pedal, char * new_pedal){
 #ifdef VERBOSE
   Log( "%s:%d\n", __FILE__, __LINE__);
 #endif
   if ( pedal == NULL ) {
-    return;
+    return 0;
   }
   
   struct pedal_config * pc;
@@ -202,7 +321,9 @@ void deimplement_pedal(char * pedal, char * new_pedal){
       
       // Check that the connection exists before disconnecting it.      
       if(connected(src_port, dst_port)){
+	uint64_t t = now_usec();
 	int r = jack_disconnect(CLIENT, src_port, dst_port);  
+	trace_jack(TRACE_OP_DISCONNECT, r, t, src_port, dst_port);
 	if(r != 0 && r != EEXIST){
 
 	  /*
@@ -217,7 +338,7 @@ void deimplement_pedal(char * pedal, char * new_pedal){
 	      __FILE__, __LINE__, *pedal, src_port, dst_port, r,
 	      bail_out ? " Bailing out" : " Every thing is OK");
 	  if(bail_out) {
-	    exit(-1);
+	    return -1;
 	  }
 	}
       }
@@ -226,10 +347,69 @@ void deimplement_pedal(char * pedal, char * new_pedal){
 #ifdef VERBOSE
   Log( "%s:%d\n", __FILE__, __LINE__);
 #endif
+  return 0;
+}
+
+// Times of the switches `change_pedal` has made.  For the control
+// API's `stats`
+struct SwitchStats {
+  unsigned switches;
+  unsigned failures;
+  uint64_t last_usec;
+  uint64_t total_usec;
+  uint64_t max_usec;
+};
+struct SwitchStats switch_stats;
+
+// Switch from `old_pedal` to `new_pedal`: Connect the new pedal then
+// disconnect what of the old pedal the new one does not use.  This is
+// the switch engine.  Returns 0 on success or -1 on failure
+int change_pedal(char * old_pedal, char * new_pedal){
+  if(new_pedal == NULL){
+    return 0;
+  }
+  trace_switch(old_pedal, new_pedal);
+
+  struct timeval a, b, c;
+  int r;
+
+  gettimeofday(&a, NULL);
+
+  r = implement_pedal(new_pedal);
+
+  gettimeofday(&b, NULL);
+
+  if(r == 0){
+    r = deimplement_pedal(old_pedal, new_pedal);
+  }
+
+  gettimeofday(&c, NULL);
+
+  Log("Implement %c: %ld\n", *new_pedal,
+      ((b.tv_sec - a.tv_sec) * 1000000) +
+      (b.tv_usec - a.tv_usec));
+
+  Log( "Deimplement %c: %ld\n", old_pedal?*old_pedal:'-',
+       ((c.tv_sec - b.tv_sec) * 1000000) +
+       (c.tv_usec - b.tv_usec));
+  Log("Total: %ld\n", ((c.tv_sec - a.tv_sec) * 1000000) +
+      (c.tv_usec - a.tv_usec));
+  uint64_t usec = ((c.tv_sec - a.tv_sec) * 1000000) +
+    (c.tv_usec - a.tv_usec);
+  trace_switch_done(r, usec);
+  switch_stats.switches++;
+  switch_stats.failures += r < 0;
+  switch_stats.last_usec = usec;
+  switch_stats.total_usec += usec;
+  if(usec > switch_stats.max_usec){
+    switch_stats.max_usec = usec;
+  }
+  return r;
 }
 
 // Test if these two ports are connected
 int connected(const char * port_a, const char * port_b) {
+  uint64_t t = now_usec();
   jack_port_t * jpt_a = jack_port_by_name(CLIENT, port_a);
 #ifdef VERBOSE
   jack_port_t * jpt_b  = jack_port_by_name(CLIENT, port_b);
@@ -238,7 +418,9 @@ int connected(const char * port_a, const char * port_b) {
   Log( "%s:%d port_a: %s port_b: %s res1: %d res2: %d\n",
        __FILE__, __LINE__, port_a, port_b, res1, res2);
 #endif
-  return jack_port_connected_to(jpt_a, port_b);
+  int r = jack_port_connected_to(jpt_a, port_b);
+  trace_jack(TRACE_OP_CONNECTED, r, t, port_a, port_b);
+  return r;
 }
 
 /* Tests if the `bit`th bit is set in `array.  Used to detect pedal
@@ -317,15 +499,101 @@ void add_pedal_effect(char pedal, const char * jc1, const char* jc2){
   
   strncpy(pc->connections[pc->n_connections - 1].ports[0], jc1, jc1_len);
   strncpy(pc->connections[pc->n_connections - 1].ports[1], jc2, jc2_len);
+  trace_config(pedal, jc1, jc2);
+
+}
 
+// A mod-host command in a pedal file.  `add <uri> <instance>` declares
+// an effect the pedal uses and `param_set <instance> <symbol> <value>`
+// sets one of its parameters.  `mod-host <port>` says which mod-host
+// the effects after it are in.  `name` is the file, for the log
+void add_pedal_mod_host(struct pedal_config * pc, const char * name,
+			const char * line){
+  char uri[PATH_MAX], symbol[64];
+  unsigned instance;
+  float value;
+  int port;
+
+  if(sscanf(line, "mod-host %d", &port) == 1 && port > 0){
+    pc->mod_host_port = port;
+    mod_host_on(port);
+  }else if(sscanf(line, "add %1023s %u", uri, &instance) == 2){
+    pc->n_effects++;
+    pc->effects = realloc(pc->effects,
+			  pc->n_effects * sizeof(struct pedal_effect));
+    assert(pc->effects);
+    struct pedal_effect * pe = &pc->effects[pc->n_effects - 1];
+    memset(pe, 0, sizeof(*pe));
+    pe->instance = instance;
+    pe->uri = strdup(uri);
+    assert(pe->uri);
+    pe->port = pc->mod_host_port ? pc->mod_host_port : MOD_HOST_PORT;
+  }else if(sscanf(line, "param_set %u %63s %f",
+		  &instance, symbol, &value) == 3){
+    struct pedal_effect * pe = NULL;
+    for(unsigned i = 0; i < pc->n_effects; i++){
+      if(pc->effects[i].instance == instance){
+	pe = &pc->effects[i];
+      }
+    }
+    if(!pe){
+      Log("%s:%d: %s: param_set for %u before it is added\n",
+	  __FILE__, __LINE__, name, instance);
+      return;
+    }
+    pe->n_params++;
+    pe->params = realloc(pe->params,
+			 pe->n_params * sizeof(struct pedal_param));
+    assert(pe->params);
+    strcpy(pe->params[pe->n_params - 1].symbol, symbol);
+    pe->params[pe->n_params - 1].value = value;
+  }else{
+    Log("%s:%d: %s: Not understood: %s\n",
+	__FILE__, __LINE__, name, line);
+  }
+}
+
+// A `jack <src> <dst>` line in a pedal or board file: A connection
+// between effects inside the board.  `name` is the file, for the log
+void add_pedal_internal(struct pedal_config * pc, const char * name,
+			const char * line){
+  char src[320], dst[320];
+  if(sscanf(line, "jack %319s %319s", src, dst) != 2){
+    Log("%s:%d: %s: Not understood: %s\n",
+	__FILE__, __LINE__, name, line);
+    return;
+  }
+  pc->n_internal++;
+  pc->internal = realloc(pc->internal,
+			 pc->n_internal * sizeof(struct jack_connection));
+  assert(pc->internal);
+  pc->internal[pc->n_internal - 1].ports[0] = strdup(src);
+  pc->internal[pc->n_internal - 1].ports[1] = strdup(dst);
+  assert(pc->internal[pc->n_internal - 1].ports[0] &&
+	 pc->internal[pc->n_internal - 1].ports[1]);
 }
 
 /* Called on setup and when signaled to set up pedal effects, this is
    one line in the configuration file. Pedals are defined by jack
    plumbing.  Each line in a pedal file is the destination (src/sink)
-   of a jack pipe.  This sets up those pipes 
+   of a jack pipe.  This sets up those pipes.  A pedal file can also
+   declare the effects it uses with mod-host `add` and `param_set`
+   lines
 */
 void process_line(char pedal, char * line){
+  if(!strncmp(line, "add ", 4) || !strncmp(line, "param_set ", 10) ||
+     !strncmp(line, "mod-host ", 9)){
+    char name[8];
+    snprintf(name, sizeof(name), "Pedal %c", pedal);
+    add_pedal_mod_host(get_pedal_config(pedal), name, line);
+    return;
+  }
+  if(!strncmp(line, "jack ", 5)){
+    char name[8];
+    snprintf(name, sizeof(name), "Pedal %c", pedal);
+    add_pedal_internal(get_pedal_config(pedal), name, line);
+    return;
+  }
   const char * src_port, * dst_port;
   char * tok = strtok(line, " ");
   src_port = tok;
@@ -347,7 +615,7 @@ void clear_jack(){
   ports_to_disconnect =  jack_get_ports(CLIENT, "system",
 					"32 bit float mono audio", 0 );
   int i;
-  for(i = 0; ports_to_disconnect[i]; i++){
+  for(i = 0; ports_to_disconnect && ports_to_disconnect[i]; i++){
     /* Log( "ports_to_disconnect[%d]: %s\n", i, ports_to_disconnect[i]); */
     jack_port_disconnect(CLIENT, jack_port_by_name(CLIENT,
 						   ports_to_disconnect[i]));
@@ -397,7 +665,10 @@ int load_pedal(char p){
     if((ch >= 'a'  && ch <= 'z') ||
        (ch >= 'A'  && ch <= 'Z') ||
        (ch >= '0' && ch <= '9') ||
-       ch == '_' || ch == ' ' || ch == ':' || ch == '\n'){
+       ch == '_' || ch == ' ' || ch == ':' || ch == '\n' ||
+       // For the URIs and values in `add` and `param_set` lines
+       ch == '/' || ch == '.' || ch == '-' || ch == '#' || ch == '%' ||
+       ch == '~' || ch == '+'){
 
       if(line[i] == '\n'){
 	line[i] = '\0';
@@ -413,6 +684,8 @@ int load_pedal(char p){
     }
   }
 
+  fclose(fd);
+
   // Ensure that no line overflowed the buffer
   if(i >= LINE_MAX){
     Log("i: %d script: %s\n", i, scriptname);
@@ -421,6 +694,48 @@ int load_pedal(char p){
   return 0;
 }
 
+// Read the effects, and the connections between them, that every
+// board file in PEDALS declares into `boards`.  The links A, B, and C, and dot files, are skipped
+void load_boards(){
+  char dir_name[PATH_MAX], file_name[PATH_MAX];
+  char line[PATH_MAX + 256];
+  assert(snprintf(dir_name, PATH_MAX, "%s/PEDALS", home_dir) < PATH_MAX);
+  DIR * dir = opendir(dir_name);
+  if(!dir){
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, dir_name, strerror(errno));
+    return;
+  }
+  struct dirent * de;
+  while((de = readdir(dir))){
+    struct stat sb;
+    if(de->d_name[0] == '.' ||
+       (de->d_name[0] >= 'A' && de->d_name[0] <= 'C' && !de->d_name[1])){
+      continue;
+    }
+    assert(snprintf(file_name, PATH_MAX, "%s/%s", dir_name,
+		    de->d_name) < PATH_MAX);
+    FILE * fd = NULL;
+    if(stat(file_name, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+       !(fd = fopen(file_name, "r"))){
+      continue;
+    }
+    boards.mod_host_port = 0;
+    while(fgets(line, sizeof(line), fd)){
+      line[strcspn(line, "\n")] = '\0';
+      if(!strncmp(line, "add ", 4) || !strncmp(line, "param_set ", 10) ||
+	 !strncmp(line, "mod-host ", 9)){
+	add_pedal_mod_host(&boards, de->d_name, line);
+      }else if(!strncmp(line, "jack ", 5)){
+	add_pedal_internal(&boards, de->d_name, line);
+      }
+    }
+    fclose(fd);
+  }
+  closedir(dir);
+  boards.mod_host_port = 0;
+}
+
 void jack_error_cb(const char * msg){
   Log( "JACK ERROR: %s\n", msg);
 }
@@ -448,7 +763,7 @@ int get_foot_pedal_fd(const char * vendor_code, const char * product_code) {
   
   if(device_path_p == NULL) {
     fprintf(stderr, "Error %s\n", strerror(errno));
-    return errno;
+    return -1;
   }
 
   // This is a property of `realpath(3)` when it succeeds
@@ -461,224 +776,3975 @@ int get_foot_pedal_fd(const char * vendor_code, const char * product_code) {
   return result;
 }
 
-int main(int argc, char * argv[]) {
-
-  // Defined in jack.h(?)
-  jack_status_t status;
-
-  unsigned buff_size = 1023;
-  char buf[buff_size + 1];
+//+===========+++++========++++++=================
+// Connection to mod-host
+//
+// A single TCP connection to mod-host's command port is kept open
+// for the life of the driver.  Connecting for every command (like
+// `process_modep.pl` does) is far too slow for a swept expression
+// pedal.  If mod-host goes away the connection is dropped and
+// re-established the next time there is something to send
 
-  fd_set rfds;
-  struct timeval tv;
+struct mod_host {
+  int port;
 
-  int retval, res;
-  unsigned yalv;//, last_yalv;
-  uint8_t key_b[KEY_MAX/8 + 1];
-  char * mi_root;
+  // -1 when not connected
+  int fd;
 
-  struct sigaction act;
-  memset (&act, 0, sizeof (act));
-  act.sa_handler = signal_handler;
-  act.sa_flags = SA_RESTART | SA_NODEFER;
-  if (sigaction (SIGHUP, &act, NULL) < 0) {
-    perror ("sigaction");
-    exit (-1);
-  }
+  // Number of commands sent that have not had a `resp` yet.
+  // Expression pedal values are sent one at a time, so a sweep does
+  // not flood mod-host's socket.  Idle effects send a batch of
+  // `activate`/`bypass` commands and wait for all the responses
+  unsigned in_flight;
 
+  // When the last command was sent
+  uint64_t sent;
 
-  mi_root = getenv("PATH_MI_ROOT");
-  if(!mi_root){
-    mi_root = "/home/patch/ModHostPedal";
-  }
-  assert(snprintf(home_dir, PATH_MAX, "%s", mi_root) <= PATH_MAX);
-  if(chdir(home_dir)){
-    // FIXME An error message
-    assert(0);
-  }
+  // Status from the last response
+  int status;
 
-  // Initialise the definitions of pedals
-  // Signal with HUP to change
-  initialise_pedals();
-  
-  pid_t pid = getpid();
-  int fd_pid = open(".driver.pid", O_WRONLY|O_CREAT, 0644);
-  if(fd_pid < 0){
-    Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno));
-    exit(fd_pid);
-  }
-  
-  // Lock the file because the front end used this to communicate with
-  // this programme.  
-  if(!fcntl(fd_pid, F_SETLK, F_WRLCK)){
-    Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno));
-    exit(-1);
-  }
+  // Value from the last response to `param_get`
+  float value;
 
-  int pid_res = dprintf(fd_pid, "%d", pid);
+  // A partially read response
+  char resp[64];
+  unsigned resp_len;
+};
 
-  if(close(fd_pid) < 0){
-    Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno));
-    return -1;
-  }	
+// The mod-host processes.  The first is on MOD_HOST_PORT.  Pedal files
+// can put effects in others (one per core, say) with `mod-host <port>`
+// lines.  Effects are JACK clients named for their instance whichever
+// mod-host they are in, so the switch engine does not care
+#define MAX_MOD_HOSTS 8
+struct mod_host mod_hosts[MAX_MOD_HOSTS] = {
+  {MOD_HOST_PORT, -1, 0, 0, 0, 0, "", 0}
+};
+unsigned n_mod_hosts = 1;
 
-  Log( "Wrote pid: %d. Error: %s\n", pid, strerror(errno));
-  assert(pid_res > 0);
+// Returned by `mod_host_command` when there is no mod-host to talk to
+#define MOD_HOST_LOST -9999
 
-  
+// If mod-host has not answered in this long assume it is wedged
+#define MOD_HOST_TIMEOUT_USEC 1000000
 
-  /* Set up the client for jack */
-  CLIENT = jack_client_open ("client_name", JackNullOption, &status);
-  if (CLIENT == NULL) {
-    fprintf (stderr, "jack_client_open() failed, "
-	     "status = 0x%2.0x\n", status);
-    if (status & JackServerFailed) {
-      fprintf (stderr, "Unable to connect to JACK server\n");
-    }
-    exit (1);
+void mod_host_close(struct mod_host * mh){
+  if(mh->fd >= 0){
+    close(mh->fd);
   }
+  mh->fd = -1;
+  mh->in_flight = 0;
+  mh->resp_len = 0;
+}
 
-  // The keyboard/pedal
-  int fd = get_foot_pedal_fd("1a86","e026");
+// Returns 0 on success.  On failure it is logged and -1 returned.
+// The caller tries again later
+int mod_host_connect(struct mod_host * mh){
+  if(mh->fd >= 0){
+    return 0;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
   if(fd < 0){
-    return fd;
+    Log("%s:%d: socket Error %s\n", __FILE__, __LINE__, strerror(errno));
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(mh->port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    Log("%s:%d: Failed to connect to mod-host on %d. Error %s\n",
+	__FILE__, __LINE__, mh->port, strerror(errno));
+    close(fd);
+    return -1;
   }
-  
-  unsigned last_yalv = 0;
 
-  char * current_pedal = NULL;
-  char A = 'A', B = 'B', C = 'C';
+  // Commands are tiny.  Do not let Nagle sit on them
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  mh->fd = fd;
+  mh->in_flight = 0;
+  mh->resp_len = 0;
+  return 0;
+}
 
-#ifdef PROFILE
-  int loop_limit = 0;
+// Send one command.  Does not wait for the response, that is read by
+// `mod_host_read` when the socket is readable.  Returns 0 on success
+int mod_host_send(struct mod_host * mh, const char * cmd){
+  if(mod_host_connect(mh) < 0){
+    return -1;
+  }
+  char buf[1024];
+  int n = snprintf(buf, sizeof(buf), "%s\n", cmd);
+  assert(n < sizeof(buf));
+  if(send(mh->fd, buf, n, MSG_NOSIGNAL) != n){
+    Log("%s:%d: Failed to send '%s' to mod-host. Error %s\n",
+	__FILE__, __LINE__, cmd, strerror(errno));
+    mod_host_close(mh);
+    return -1;
+  }
+#ifdef VERBOSE
+  Log("mod-host: %s\n", cmd);
 #endif
-  Log("Starting main loop\n");
-  while(RUNNING == 1){
-#ifdef PROFILE
-    if(loop_limit++ > 12){
-      RUNNING = 0;
+  trace_mod_host(cmd);
+  mh->in_flight++;
+  mh->sent = now_usec();
+  return 0;
+}
+
+// Read whatever mod-host has sent.  Each response is "resp <status>"
+// terminated by a '\0'.  Negative status is an error (see the table
+// in `process_modep.pl`).  Returns the number of responses read or
+// -1 if the connection was lost
+int mod_host_read(struct mod_host * mh){
+  char buf[256];
+  int n = read(mh->fd, buf, sizeof(buf));
+  if(n <= 0){
+    Log("%s:%d: Lost connection to mod-host. Error %s\n",
+	__FILE__, __LINE__, n < 0 ? strerror(errno) : "EOF");
+    mod_host_close(mh);
+    return -1;
+  }
+  int responses = 0;
+  for(int i = 0; i < n; i++){
+    if(buf[i] != '\0'){
+      if(mh->resp_len < sizeof(mh->resp) - 1){
+	mh->resp[mh->resp_len++] = buf[i];
+      }
+      continue;
     }
-#endif
-    tv.tv_sec = 200;
-    tv.tv_usec = 0;
+    mh->resp[mh->resp_len] = '\0';
+    int status = 0;
+    mh->value = 0;
+    if(sscanf(mh->resp, "resp %d %f", &status, &mh->value) >= 1 &&
+       status < 0 &&
+       status != -2){
+      // -2 is ERR_INSTANCE_ALREADY_EXISTS.  Expected when replaying
+      Log("%s:%d: mod-host FAIL: %s\n", __FILE__, __LINE__, mh->resp);
+    }
+    mh->status = status;
+    trace_mod_host_resp(status);
+    mh->resp_len = 0;
+    if(mh->in_flight > 0){
+      mh->in_flight--;
+    }
+    responses++;
+  }
+  return responses;
+}
+
+// Wait for the responses to everything in flight.  `cmd` is the last
+// command sent, for the log.  Returns the last status mod-host
+// responded with or MOD_HOST_LOST
+int mod_host_wait(struct mod_host * mh, const char * cmd){
+  if(mh->fd < 0){
+    return MOD_HOST_LOST;
+  }
+  while(mh->in_flight > 0){
+    fd_set rfds;
+    struct timeval tv;
+    tv.tv_sec = MOD_HOST_TIMEOUT_USEC / 1000000;
+    tv.tv_usec = MOD_HOST_TIMEOUT_USEC % 1000000;
     FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
-    retval = select(fd+1, &rfds, NULL, NULL, &tv);
+    FD_SET(mh->fd, &rfds);
+    int r = select(mh->fd + 1, &rfds, NULL, NULL, &tv);
+    if(r < 0 && errno == EINTR){
+      continue;
+    }
+    if(r <= 0){
+      Log("%s:%d: No response from mod-host to '%s'\n",
+	  __FILE__, __LINE__, cmd);
+      mod_host_close(mh);
+      return MOD_HOST_LOST;
+    }
+    if(mod_host_read(mh) < 0){
+      return MOD_HOST_LOST;
+    }
+  }
+  return mh->status;
+}
 
-    if(retval < 0){
-      Log("select Error %s\n", strerror(errno));
+// Send a command and wait for its response.  Anything already in
+// flight is waited for too.  Returns the status mod-host responded
+// with or MOD_HOST_LOST
+int mod_host_command(struct mod_host * mh, const char * cmd){
+  if(mod_host_send(mh, cmd) < 0){
+    return MOD_HOST_LOST;
+  }
+  return mod_host_wait(mh, cmd);
+}
 
-      // TODO: What is this constant: 4?
-      if(errno == 4){
-	
-	// Interupted by a signal
-	Log( "%s:%d: signaled: %d\n",
-	     __FILE__, __LINE__, signaled);
-	if(signaled){
-	  fprintf(stderr, "signaled\n");
-	  destroy_pedals();
-	  initialise_pedals();
-	}
-	signaled = 0;
-	continue;
-      }
-      return -1;
-    }else if(retval == 0){
-#ifdef VERBOSE
-      Log("Heartbeat...");
-#endif
-      continue;
+// The mod-host on `port`.  Added to `mod_hosts` the first time it is
+// asked for.  0 is MOD_HOST_PORT
+struct mod_host * mod_host_on(int port){
+  if(port == 0){
+    port = MOD_HOST_PORT;
+  }
+  for(unsigned i = 0; i < n_mod_hosts; i++){
+    if(mod_hosts[i].port == port){
+      return &mod_hosts[i];
     }
+  }
+  if(n_mod_hosts == MAX_MOD_HOSTS){
+    Log("%s:%d: Too many mod-hosts.  Using %d for %d\n",
+	__FILE__, __LINE__, MOD_HOST_PORT, port);
+    return &mod_hosts[0];
+  }
+  struct mod_host * mh = &mod_hosts[n_mod_hosts++];
+  memset(mh, 0, sizeof(*mh));
+  mh->port = port;
+  mh->fd = -1;
+  return mh;
+}
 
-    // Read the keyboard
-    memset(key_b, 0, sizeof(key_b));
-    if(ioctl(fd, EVIOCGKEY(sizeof(key_b)), key_b) == -1){
-      printf("IOCTL Error %s\n", strerror(errno));
-      return -1;
+// Connect to every mod-host.  Returns 0, or -1 if any is not there
+int mod_hosts_connect(){
+  int r = 0;
+  for(unsigned i = 0; i < n_mod_hosts; i++){
+    if(mod_host_connect(&mod_hosts[i]) < 0){
+      r = -1;
     }
-    /* Log( "IOCTL returnes\n"); */
-    
-    for (yalv = 0; yalv < KEY_MAX; yalv++) {
-      if (test_bit(yalv, key_b)) {
-	/* the bit is set in the key state */
-	if(last_yalv != yalv){
-	  /* Only when it changes */
-	  char * old_pedal = current_pedal;
+  }
+  return r;
+}
 
-	  if(yalv == 0x1e){
-	    current_pedal = &A;
-	  }else if(yalv == 0x30){
-	    current_pedal = &B;
-	  }else if(yalv == 0x2e){
-	    current_pedal = &C;
-	  }	    
-	  last_yalv = yalv;
-	  struct timeval a, b, c;
+//+===========+++++========++++++=================
+// Expression pedals
+//
+// Continuous controllers (the absolute axes of an evdev device, or
+// MIDI control change messages from a raw MIDI device) are mapped to
+// LV2 parameters in mod-host.  The mapping is in PEDALS/.CONTROLS,
+// one mapping per line:
+//
+//   evdev <device> <axis> <instance>/<symbol> <min> <max>
+//   midi <device> <channel> <cc> <instance>/<symbol> <min> <max>
+//
+// <device> is a path like /dev/input/by-id/usb-...-event-joystick or
+// /dev/snd/midiC1D0.  <axis> is the ABS_* code as a number.
+// <channel> is 1-16 or '*' for any.  <instance> is the number given
+// to mod-host's `add`.  The controller's range is scaled onto
+// <min>..<max>
+//
+// A sweep produces far more values than mod-host needs.  Values are
+// coalesced: each mapping only remembers its latest value and once
+// every CONTROL_PERIOD_USEC the latest value of each parameter that
+// changed is sent as a `param_set`.
 
-	  gettimeofday(&a, NULL);
+#define MAX_CONTROLS 32
 
-	  implement_pedal(current_pedal);
+// How often to send parameter values to mod-host.  5ms is about the
+// same as a JACK period
+#define CONTROL_PERIOD_USEC 5000
 
-	  gettimeofday(&b, NULL);
+enum control_type {CONTROL_EVDEV, CONTROL_MIDI};
 
-	  deimplement_pedal(old_pedal, current_pedal);
-/* #ifdef VERBOSE */
-/* 	  Log("%s:%d implement pedal: %c", */
-/* 	      __FILE__, __LINE__, current_pedal); */
-/* 	  struct pedal_config * pc = get_pedal_config(*current_pedal); */
-/* 	  assert(pc->connections[0].ports); */
-/* #endif */
+// A device that controllers are read from
+struct control_source {
+  enum control_type type;
+  char path[PATH_MAX];
+  int fd;
 
-	  gettimeofday(&c, NULL);
+  // MIDI parser state.  MIDI uses "running status" so the last
+  // status byte applies to data bytes that follow it
+  uint8_t status;
+  uint8_t data;
+  unsigned n_data;
+};
 
-	  Log("Implement %c: %ld\n", *current_pedal,
-	      ((b.tv_sec - a.tv_sec) * 1000000) +
-	      (b.tv_usec - a.tv_usec));
+// A controller mapped to a parameter
+struct control_map {
+  unsigned source; // Index into `controls.sources`
+  unsigned code; // evdev axis or MIDI CC number
+  int channel; // MIDI channel 0-15 or -1 for any
+  int raw_min, raw_max; // Range the controller reports
+  unsigned instance;
+  char symbol[64];
+  float min, max; // Range of the parameter
 
-	  
-	  Log( "Deimplement %c: %ld\n", old_pedal?*old_pedal:'-',
-	       ((c.tv_sec - b.tv_sec) * 1000000) +
-	       (c.tv_usec - b.tv_usec));
-	  Log("Total: %ld\n", ((c.tv_sec - a.tv_sec) * 1000000) +
-	      (c.tv_usec - a.tv_usec));
-	}
+  float value; // The latest value
+  int dirty; // `value` has not been sent
+  int queued; // To be sent in the current period
+};
 
-	// Write a record of the pedal in a known location so other
-	// programmes can know what pedal is selected
-	int fd_pedal;
-	char file_name[PATH_MAX];
-	assert(snprintf(file_name, PATH_MAX, "%s/PEDALS/.PEDAL", home_dir) < PATH_MAX);
-	fd_pedal = open(file_name, O_WRONLY); // File must exist
-	if(fd_pedal < 0) {
-	  Log("%s:%d: Failed to open %s. Error %s\n",
-	      __FILE__, __LINE__, file_name, strerror(errno));
-	  return fd;
-	}
+struct Controls {
+  struct control_source sources[MAX_CONTROLS];
+  unsigned n_sources;
+  struct control_map maps[MAX_CONTROLS];
+  unsigned n_maps;
 
-	// Programmes using this file must get a lock to read it.  
-	if(!fcntl(fd_pedal, F_SETLK, F_WRLCK)){
-	  Log("%s:%d: Failed to lock %s. Error %s\n",
-	      __FILE__, __LINE__, file_name, strerror(errno));
-	  /* Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno)); */
-	  return -1;
-	}
-	
-	if(dprintf(fd_pedal,
-		   "%c", current_pedal ? *current_pedal : ' ') <= 0){
-	  Log("%s:%d: Failed to write to %s. Error %s\n",
-	      __FILE__, __LINE__, file_name, strerror(errno));
-	  return -1;
-	}
+  // When the current period started
+  uint64_t period_start;
+};
+struct Controls controls;
 
-	if(close(fd_pedal) < 0){
-	  Log("%s:%d: Failed to close %s. Error %s\n",
-	      __FILE__, __LINE__, file_name, strerror(errno));
-	  return -1;
-	}	
-      }
+// Find or open a source device.  Returns the index in
+// `controls.sources` or -1
+int control_source(enum control_type type, const char * path){
+  for(unsigned i = 0; i < controls.n_sources; i++){
+    if(controls.sources[i].fd >= 0 &&
+       controls.sources[i].type == type &&
+       !strcmp(controls.sources[i].path, path)){
+      return i;
     }
+  }
+  if(controls.n_sources == MAX_CONTROLS){
+    Log("%s:%d: Too many control devices.  Ignoring %s\n",
+	__FILE__, __LINE__, path);
+    return -1;
+  }
+  int fd = open(path, O_RDONLY|O_NONBLOCK);
+  if(fd < 0){
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, path, strerror(errno));
+    return -1;
+  }
+  struct control_source * cs = &controls.sources[controls.n_sources];
+  memset(cs, 0, sizeof(*cs));
+  cs->type = type;
+  assert(snprintf(cs->path, PATH_MAX, "%s", path) < PATH_MAX);
+  cs->fd = fd;
+  return controls.n_sources++;
+}
 
-    /* Consume what can be read from fd */
+// Parse one line of PEDALS/.CONTROLS.  Returns 0 on success
+int process_control_line(char * line){
+  char type[16], path[PATH_MAX], target[128];
+  char channel[8];
+  unsigned code;
+  float min, max;
+  struct control_map cm;
+  memset(&cm, 0, sizeof(cm));
+  cm.channel = -1;
+
+  if(sscanf(line, "evdev %1023s %u %127s %f %f",
+	    path, &code, target, &min, &max) == 5){
+    snprintf(type, sizeof(type), "evdev");
+  }else if(sscanf(line, "midi %1023s %7s %u %127s %f %f",
+		  path, channel, &code, target, &min, &max) == 6){
+    snprintf(type, sizeof(type), "midi");
+    if(strcmp(channel, "*")){
+      cm.channel = atoi(channel) - 1;
+      if(cm.channel < 0 || cm.channel > 15){
+	return -1;
+      }
+    }
+  }else{
+    return -1;
+  }
+
+  char * slash = strchr(target, '/');
+  if(!slash || slash == target || !slash[1] ||
+     strlen(slash + 1) >= sizeof(cm.symbol)){
+    return -1;
+  }
+  *slash = '\0';
+  cm.instance = atoi(target);
+  strcpy(cm.symbol, slash + 1);
+  cm.code = code;
+  cm.min = min;
+  cm.max = max;
+
+  int s;
+  if(!strcmp(type, "evdev")){
+    s = control_source(CONTROL_EVDEV, path);
+    if(s < 0){
+      return 0; // Logged. Not a syntax error
+    }
+    // Ask the device for the range of the axis
+    struct input_absinfo absinfo;
+    if(ioctl(controls.sources[s].fd, EVIOCGABS(code), &absinfo) < 0){
+      Log("%s:%d: %s has no axis %u. Error %s\n",
+	  __FILE__, __LINE__, path, code, strerror(errno));
+      return 0;
+    }
+    cm.raw_min = absinfo.minimum;
+    cm.raw_max = absinfo.maximum;
+  }else{
+    s = control_source(CONTROL_MIDI, path);
+    if(s < 0){
+      return 0;
+    }
+    cm.raw_min = 0;
+    cm.raw_max = 127;
+  }
+  cm.source = s;
+
+  if(controls.n_maps == MAX_CONTROLS){
+    Log("%s:%d: Too many controls\n", __FILE__, __LINE__);
+    return 0;
+  }
+  controls.maps[controls.n_maps++] = cm;
+  return 0;
+}
+
+// Called on set up and when signaled.  Reads PEDALS/.CONTROLS.  The
+// file is optional
+void initialise_controls(){
+  char file_name[PATH_MAX];
+  char line[PATH_MAX + 256];
+
+  memset(&controls, 0, sizeof(controls));
+  assert(snprintf(file_name, PATH_MAX, "%s/PEDALS/.CONTROLS",
+		  home_dir) < PATH_MAX);
+  FILE * fd = fopen(file_name, "r");
+  if(!fd){
+    return;
+  }
+  unsigned ln = 0;
+  while(fgets(line, sizeof(line), fd)){
+    ln++;
+    char * p = line;
+    while(*p == ' ' || *p == '\t'){
+      p++;
+    }
+    if(*p == '#' || *p == '\n' || *p == '\0'){
+      continue;
+    }
+    if(process_control_line(p)){
+      Log("%s:%d: %s line %u not understood: %s",
+	  __FILE__, __LINE__, file_name, ln, line);
+    }
+  }
+  fclose(fd);
+  Log("Controls: %u mapped from %u devices\n",
+      controls.n_maps, controls.n_sources);
+}
+
+void destroy_controls(){
+  for(unsigned i = 0; i < controls.n_sources; i++){
+    if(controls.sources[i].fd >= 0){
+      close(controls.sources[i].fd);
+    }
+  }
+  memset(&controls, 0, sizeof(controls));
+}
+
+// A controller on `source` moved.  Remember the value for the next
+// period
+void control_value(unsigned source, int channel, unsigned code, int raw){
+  for(unsigned i = 0; i < controls.n_maps; i++){
+    struct control_map * cm = &controls.maps[i];
+    if(cm->source != source || cm->code != code ||
+       (cm->channel >= 0 && cm->channel != channel)){
+      continue;
+    }
+    float range = cm->raw_max - cm->raw_min;
+    float x = range > 0 ? (raw - cm->raw_min) / range : 0;
+    if(x < 0){
+      x = 0;
+    }else if(x > 1){
+      x = 1;
+    }
+    cm->value = cm->min + x * (cm->max - cm->min);
+    cm->dirty = 1;
+  }
+}
+
+// A source device that can not be read (unplugged) stays readable
+// for select, so close it and drop the controllers mapped to it.  Its
+// index is left in place, with fd -1, so the other maps stay valid
+void drop_control_source(unsigned s){
+  struct control_source * cs = &controls.sources[s];
+  Log("%s:%d: Dropping control device %s. Error %s\n",
+      __FILE__, __LINE__, cs->path, errno ? strerror(errno) : "EOF");
+  close(cs->fd);
+  cs->fd = -1;
+  unsigned n = 0;
+  for(unsigned i = 0; i < controls.n_maps; i++){
+    if(controls.maps[i].source != s){
+      controls.maps[n++] = controls.maps[i];
+    }
+  }
+  controls.n_maps = n;
+}
+
+// Read what is available from a source device
+void read_control_source(unsigned s){
+  struct control_source * cs = &controls.sources[s];
+  int n;
+  errno = 0;
+  if(cs->type == CONTROL_EVDEV){
+    struct input_event ev[64];
+    while((n = read(cs->fd, ev, sizeof(ev))) > 0){
+      for(unsigned i = 0; i < n / sizeof(ev[0]); i++){
+	if(ev[i].type == EV_ABS){
+	  control_value(s, -1, ev[i].code, ev[i].value);
+	}
+      }
+    }
+  }else{
+    uint8_t buf[256];
+    while((n = read(cs->fd, buf, sizeof(buf))) > 0){
+      for(int i = 0; i < n; i++){
+	uint8_t b = buf[i];
+	if(b >= 0xF8){
+	  // Real time messages can appear anywhere.  Ignore them
+	  continue;
+	}
+	if(b & 0x80){
+	  cs->status = b;
+	  cs->n_data = 0;
+	  continue;
+	}
+	if((cs->status & 0xF0) != 0xB0){
+	  // Only interested in control change
+	  continue;
+	}
+	if(cs->n_data == 0){
+	  cs->data = b;
+	  cs->n_data = 1;
+	}else{
+	  control_value(s, cs->status & 0x0F, cs->data, b);
+	  cs->n_data = 0;
+	}
+      }
+    }
+  }
+  if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+    drop_control_source(s);
+  }
+}
+
+// Send the next queued parameter value to each mod-host.  One at a
+// time: the next is sent when that mod-host responds to the last
+void send_controls(){
+  for(unsigned i = 0; i < n_mod_hosts; i++){
+    struct mod_host * mh = &mod_hosts[i];
+    if(mh->in_flight > 0 &&
+       now_usec() - mh->sent >= MOD_HOST_TIMEOUT_USEC){
+      Log("%s:%d: mod-host on %d did not respond.  Reconnecting\n",
+	  __FILE__, __LINE__, mh->port);
+      mod_host_close(mh);
+    }
+  }
+  for(unsigned i = 0; i < controls.n_maps; i++){
+    struct control_map * cm = &controls.maps[i];
+    if(!cm->queued){
+      continue;
+    }
+    struct mod_host * mh = mod_host_for(cm->instance);
+    if(mh->in_flight > 0){
+      // One at a time for each mod-host
+      continue;
+    }
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "param_set %u %s %f",
+	     cm->instance, cm->symbol, cm->value);
+    if(mod_host_send(mh, cmd) < 0){
+      // Leave it dirty.  Try again next period
+      continue;
+    }
+    cm->queued = 0;
+    cm->dirty = 0;
+    journal_param(cm->instance, cm->symbol, cm->value);
+  }
+}
+
+// Called every time around the main loop.  If a period has passed
+// queue the parameters that have changed.  Returns the number of
+// micro seconds until the next period needs attention, or -1 if
+// nothing is waiting
+long flush_controls(){
+  int waiting = 0;
+  for(unsigned i = 0; i < controls.n_maps; i++){
+    if(controls.maps[i].dirty){
+      waiting = 1;
+      break;
+    }
+  }
+  if(!waiting){
+    return -1;
+  }
+  uint64_t now = now_usec();
+  if(now - controls.period_start >= CONTROL_PERIOD_USEC){
+    controls.period_start = now;
+    for(unsigned i = 0; i < controls.n_maps; i++){
+      if(controls.maps[i].dirty){
+	controls.maps[i].queued = 1;
+      }
+    }
+  }
+  send_controls();
+  return CONTROL_PERIOD_USEC - (now - controls.period_start);
+}
+
+//+===========+++++========++++++=================
+// Journal of the rig's state
+//
+// Getting back to a playable state after mod-host or the driver dies
+// used to mean running `EffectsStart`, and so all of
+// `process_modep.pl`, again.  Instead the state of the rig (the
+// effects instantiated in mod-host, their parameter values, the
+// connections between effects, the selected pedal and what PEDALS/A,
+// B, and C link to) is kept in
+// .journal.  It is an append only binary file that is compacted
+// (rewritten as a snapshot) from time to time.
+//
+// At start up, if .history (written by `process_modep.pl`) is newer
+// than .journal then `EffectsStart` has just built the rig from
+// scratch and the journal is seeded from .history.  Otherwise the
+// journal is replayed straight into mod-host and JACK.  It is also
+// replayed when mod-host restarts under the driver.
+//
+// After the file header every record is a `struct journal_header`
+// followed by `length` bytes of payload.  A crash can leave a torn
+// record at the end of the file.  Loading stops at the first record
+// whose checksum is wrong and the file is truncated there.
+
+#define JOURNAL_MAGIC 0x4a50484d // "MHPJ"
+#define JOURNAL_VERSION 1
+
+// Compact when this much has been appended since the last compaction
+#define JOURNAL_COMPACT_BYTES (64 * 1024)
+
+// ...and nothing (footswitch, expression pedal, idle report) has
+// happened for this long.  Compaction fsyncs, so it must not be done
+// while the rig is being played
+#define JOURNAL_COMPACT_IDLE_USEC 5000000
+
+enum journal_type {
+  JOURNAL_INSTANCE = 1, // u32 instance, URI
+  JOURNAL_REMOVE = 2, // u32 instance
+  JOURNAL_PARAM = 3, // u32 instance, float value, symbol
+  JOURNAL_PEDAL = 4, // u8 pedal
+  JOURNAL_LINK = 5, // u8 pedal, target of PEDALS/<pedal>
+  JOURNAL_MOD_HOST = 6, // u32 instance, u32 port of its mod-host
+  JOURNAL_EDGE = 7, // Source port, '\0', destination port
+};
+
+struct journal_header {
+  uint32_t checksum; // FNV-1a of `type`, `length` and payload
+  uint16_t type;
+  uint16_t length;
+};
+
+// Largest payload: A pedal and a path
+#define JOURNAL_MAX_PAYLOAD (PATH_MAX + 8)
+
+struct rig_param {
+  char symbol[64];
+  float value;
+};
+
+struct rig_instance {
+  unsigned instance;
+  char * uri;
+  int port; // Of the mod-host it is in.  0 for MOD_HOST_PORT
+  struct rig_param * params;
+  unsigned n_params;
+};
+
+// A connection between two effects that is made once, when the rig is
+// set up, rather than by selecting a pedal
+struct rig_edge {
+  char * src;
+  char * dst;
+};
+
+struct Rig {
+  struct rig_instance * instances;
+  unsigned n_instances;
+
+  struct rig_edge * edges;
+  unsigned n_edges;
+
+  // '\0' if no pedal selected
+  char pedal;
+
+  // Targets of PEDALS/A, B, and C
+  char links[3][PATH_MAX];
+};
+struct Rig rig;
+
+struct Journal {
+  int fd;
+
+  // Bytes appended since the last compaction
+  off_t appended;
+};
+struct Journal journal = {-1, 0};
+
+uint32_t journal_checksum(uint16_t type, uint16_t length,
+			  const uint8_t * payload){
+  uint32_t h = 2166136261u;
+  uint8_t tl[4] = {type & 0xff, type >> 8, length & 0xff, length >> 8};
+  for(unsigned i = 0; i < 4; i++){
+    h = (h ^ tl[i]) * 16777619u;
+  }
+  for(unsigned i = 0; i < length; i++){
+    h = (h ^ payload[i]) * 16777619u;
+  }
+  return h;
+}
+
+struct rig_instance * rig_instance(unsigned instance){
+  for(unsigned i = 0; i < rig.n_instances; i++){
+    if(rig.instances[i].instance == instance){
+      return &rig.instances[i];
+    }
+  }
+  return NULL;
+}
+
+void free_rig_instance(struct rig_instance * ri){
+  free(ri->uri);
+  free(ri->params);
+  ri->uri = NULL;
+  ri->params = NULL;
+  ri->n_params = 0;
+}
+
+void rig_clear(){
+  for(unsigned i = 0; i < rig.n_instances; i++){
+    free_rig_instance(&rig.instances[i]);
+  }
+  free(rig.instances);
+  for(unsigned i = 0; i < rig.n_edges; i++){
+    free(rig.edges[i].src);
+    free(rig.edges[i].dst);
+  }
+  free(rig.edges);
+  memset(&rig, 0, sizeof(rig));
+}
+
+// Apply a record to `rig`.  Returns 0, or -1 if the record is
+// malformed
+int rig_apply(uint16_t type, const uint8_t * payload, uint16_t length){
+  uint32_t instance = 0;
+  char str[JOURNAL_MAX_PAYLOAD + 1];
+  struct rig_instance * ri;
+
+  switch(type){
+  case JOURNAL_INSTANCE:
+    if(length <= 4){
+      return -1;
+    }
+    memcpy(&instance, payload, 4);
+    memcpy(str, payload + 4, length - 4);
+    str[length - 4] = '\0';
+    ri = rig_instance(instance);
+    if(ri){
+      // Added again.  It starts with default parameters
+      free_rig_instance(ri);
+    }else{
+      rig.n_instances++;
+      rig.instances = realloc(rig.instances,
+			      rig.n_instances * sizeof(struct rig_instance));
+      assert(rig.instances);
+      ri = &rig.instances[rig.n_instances - 1];
+      memset(ri, 0, sizeof(*ri));
+      ri->instance = instance;
+    }
+    ri->uri = strdup(str);
+    assert(ri->uri);
+    ri->port = 0;
+    break;
+
+  case JOURNAL_MOD_HOST: {
+    uint32_t port;
+    if(length != 8){
+      return -1;
+    }
+    memcpy(&instance, payload, 4);
+    memcpy(&port, payload + 4, 4);
+    ri = rig_instance(instance);
+    if(ri){
+      ri->port = port == MOD_HOST_PORT ? 0 : port;
+    }
+    break;
+  }
+
+  case JOURNAL_REMOVE:
+    if(length != 4){
+      return -1;
+    }
+    memcpy(&instance, payload, 4);
+    ri = rig_instance(instance);
+    if(ri){
+      free_rig_instance(ri);
+      *ri = rig.instances[--rig.n_instances];
+    }
+    // Its edges went with it
+    snprintf(str, sizeof(str), "effect_%u:", instance);
+    for(unsigned i = 0; i < rig.n_edges; ){
+      struct rig_edge * re = &rig.edges[i];
+      if(!strncmp(re->src, str, strlen(str)) ||
+	 !strncmp(re->dst, str, strlen(str))){
+	free(re->src);
+	free(re->dst);
+	*re = rig.edges[--rig.n_edges];
+      }else{
+	i++;
+      }
+    }
+    break;
+
+  case JOURNAL_PARAM: {
+    float value;
+    if(length <= 8 || length - 8 >= sizeof(((struct rig_param *)0)->symbol)){
+      return -1;
+    }
+    memcpy(&instance, payload, 4);
+    memcpy(&value, payload + 4, 4);
+    memcpy(str, payload + 8, length - 8);
+    str[length - 8] = '\0';
+    ri = rig_instance(instance);
+    if(!ri){
+      // Parameter for an effect that is gone
+      break;
+    }
+    unsigned i;
+    for(i = 0; i < ri->n_params; i++){
+      if(!strcmp(ri->params[i].symbol, str)){
+	break;
+      }
+    }
+    if(i == ri->n_params){
+      ri->n_params++;
+      ri->params = realloc(ri->params,
+			   ri->n_params * sizeof(struct rig_param));
+      assert(ri->params);
+      strcpy(ri->params[i].symbol, str);
+    }
+    ri->params[i].value = value;
+    break;
+  }
+
+  case JOURNAL_PEDAL:
+    if(length != 1){
+      return -1;
+    }
+    rig.pedal = payload[0];
+    break;
+
+  case JOURNAL_LINK:
+    if(length < 1 || length - 1 >= PATH_MAX ||
+       payload[0] < 'A' || payload[0] > 'C'){
+      return -1;
+    }
+    memcpy(rig.links[payload[0] - 'A'], payload + 1, length - 1);
+    rig.links[payload[0] - 'A'][length - 1] = '\0';
+    break;
+
+  case JOURNAL_EDGE: {
+    const uint8_t * nul = memchr(payload, '\0', length);
+    if(!nul || nul == payload || nul == payload + length - 1){
+      return -1;
+    }
+    memcpy(str, payload, length);
+    str[length] = '\0';
+    const char * dst = str + (nul - payload) + 1;
+    for(unsigned i = 0; i < rig.n_edges; i++){
+      if(!strcmp(rig.edges[i].src, str) && !strcmp(rig.edges[i].dst, dst)){
+	return 0;
+      }
+    }
+    rig.n_edges++;
+    rig.edges = realloc(rig.edges, rig.n_edges * sizeof(struct rig_edge));
+    assert(rig.edges);
+    rig.edges[rig.n_edges - 1].src = strdup(str);
+    rig.edges[rig.n_edges - 1].dst = strdup(dst);
+    assert(rig.edges[rig.n_edges - 1].src && rig.edges[rig.n_edges - 1].dst);
+    break;
+  }
+
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+// Write one record to `fd`.  Returns the bytes written or -1
+int journal_write(int fd, uint16_t type, const uint8_t * payload,
+		  uint16_t length){
+  uint8_t buf[sizeof(struct journal_header) + JOURNAL_MAX_PAYLOAD];
+  struct journal_header jh;
+
+  assert(length <= JOURNAL_MAX_PAYLOAD);
+  jh.type = type;
+  jh.length = length;
+  jh.checksum = journal_checksum(type, length, payload);
+  memcpy(buf, &jh, sizeof(jh));
+  memcpy(buf + sizeof(jh), payload, length);
+
+  // One write so a crash tears at most one record
+  int n = sizeof(jh) + length;
+  if(write(fd, buf, n) != n){
+    Log("%s:%d: Failed to write journal. Error %s\n",
+	__FILE__, __LINE__, strerror(errno));
+    return -1;
+  }
+  return n;
+}
+
+// Apply a record and append it to the journal
+void journal_record(uint16_t type, const uint8_t * payload,
+		    uint16_t length){
+  assert(rig_apply(type, payload, length) == 0);
+  if(journal.fd >= 0){
+    int n = journal_write(journal.fd, type, payload, length);
+    if(n > 0){
+      journal.appended += n;
+    }
+  }
+}
+
+void journal_instance(unsigned instance, const char * uri){
+  uint8_t payload[JOURNAL_MAX_PAYLOAD];
+  uint32_t i = instance;
+  unsigned len = strlen(uri);
+  assert(len + 4 <= JOURNAL_MAX_PAYLOAD);
+  memcpy(payload, &i, 4);
+  memcpy(payload + 4, uri, len);
+  journal_record(JOURNAL_INSTANCE, payload, len + 4);
+}
+
+// Record which mod-host `instance` is in, if that has changed
+void journal_mod_host(unsigned instance, int port){
+  struct rig_instance * ri = rig_instance(instance);
+  if(!ri || (ri->port ? ri->port : MOD_HOST_PORT) == port){
+    return;
+  }
+  uint32_t payload[2] = {instance, port};
+  journal_record(JOURNAL_MOD_HOST, (uint8_t *)payload, 8);
+}
+
+void journal_remove(unsigned instance){
+  uint32_t i = instance;
+  journal_record(JOURNAL_REMOVE, (uint8_t *)&i, 4);
+}
+
+void journal_param(unsigned instance, const char * symbol, float value){
+  struct rig_instance * ri = rig_instance(instance);
+  if(!ri){
+    // Not an effect the rig knows about
+    return;
+  }
+  for(unsigned i = 0; i < ri->n_params; i++){
+    if(!strcmp(ri->params[i].symbol, symbol) &&
+       ri->params[i].value == value){
+      return; // Nothing changed
+    }
+  }
+  uint8_t payload[JOURNAL_MAX_PAYLOAD];
+  uint32_t i = instance;
+  unsigned len = strlen(symbol);
+  if(len == 0 || len >= sizeof(((struct rig_param *)0)->symbol)){
+    return;
+  }
+  memcpy(payload, &i, 4);
+  memcpy(payload + 4, &value, 4);
+  memcpy(payload + 8, symbol, len);
+  journal_record(JOURNAL_PARAM, payload, len + 8);
+}
+
+// Record a connection between effects that is part of the rig, if it
+// is not already recorded
+void journal_edge(const char * src, const char * dst){
+  uint8_t payload[JOURNAL_MAX_PAYLOAD];
+  unsigned ls = strlen(src), ld = strlen(dst);
+  for(unsigned i = 0; i < rig.n_edges; i++){
+    if(!strcmp(rig.edges[i].src, src) && !strcmp(rig.edges[i].dst, dst)){
+      return;
+    }
+  }
+  assert(ls + ld + 1 <= JOURNAL_MAX_PAYLOAD);
+  memcpy(payload, src, ls + 1);
+  memcpy(payload + ls + 1, dst, ld);
+  journal_record(JOURNAL_EDGE, payload, ls + ld + 1);
+}
+
+void journal_pedal(char pedal){
+  if(rig.pedal != pedal){
+    journal_record(JOURNAL_PEDAL, (uint8_t *)&pedal, 1);
+  }
+}
+
+// Record what PEDALS/A, B, and C link to (the bank), if it has changed
+void journal_links(){
+  for(char p = 'A'; p <= 'C'; p++){
+    char link_name[PATH_MAX];
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    assert(snprintf(link_name, PATH_MAX, "%s/PEDALS/%c",
+		    home_dir, p) < PATH_MAX);
+    int len = readlink(link_name, (char *)payload + 1, PATH_MAX - 1);
+    if(len < 0){
+      continue;
+    }
+    if(strlen(rig.links[p - 'A']) == len &&
+       !memcmp(rig.links[p - 'A'], payload + 1, len)){
+      continue;
+    }
+    payload[0] = p;
+    journal_record(JOURNAL_LINK, payload, len + 1);
+  }
+}
+
+// If PEDALS/A, B, or C is missing put back what the journal has
+void journal_restore_links(){
+  for(char p = 'A'; p <= 'C'; p++){
+    char link_name[PATH_MAX];
+    struct stat sb;
+    assert(snprintf(link_name, PATH_MAX, "%s/PEDALS/%c",
+		    home_dir, p) < PATH_MAX);
+    if(!rig.links[p - 'A'][0] || lstat(link_name, &sb) == 0){
+      continue;
+    }
+    if(symlink(rig.links[p - 'A'], link_name) < 0){
+      Log("%s:%d: Failed to restore %s. Error %s\n",
+	  __FILE__, __LINE__, link_name, strerror(errno));
+    }
+  }
+}
+
+// Read the journal into `rig`.  Returns 0 on success, -1 if there is
+// no usable journal
+int journal_load(const char * file_name){
+  int fd = open(file_name, O_RDWR);
+  if(fd < 0){
+    return -1;
+  }
+  uint32_t file_header[2];
+  if(read(fd, file_header, sizeof(file_header)) != sizeof(file_header) ||
+     file_header[0] != JOURNAL_MAGIC || file_header[1] != JOURNAL_VERSION){
+    Log("%s:%d: %s is not a journal\n", __FILE__, __LINE__, file_name);
+    close(fd);
+    return -1;
+  }
+
+  rig_clear();
+  off_t good = sizeof(file_header);
+  unsigned n_records = 0;
+  for(;;){
+    struct journal_header jh;
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    if(read(fd, &jh, sizeof(jh)) != sizeof(jh) ||
+       jh.length > JOURNAL_MAX_PAYLOAD ||
+       read(fd, payload, jh.length) != jh.length ||
+       jh.checksum != journal_checksum(jh.type, jh.length, payload) ||
+       rig_apply(jh.type, payload, jh.length) < 0){
+      break;
+    }
+    good += sizeof(jh) + jh.length;
+    n_records++;
+  }
+  struct stat sb;
+  if(fstat(fd, &sb) == 0 && sb.st_size != good){
+    Log("%s:%d: Torn journal.  Truncated from %ld to %ld bytes\n",
+	__FILE__, __LINE__, (long)sb.st_size, (long)good);
+    if(ftruncate(fd, good) < 0){
+      Log("%s:%d: Failed to truncate %s. Error %s\n",
+	  __FILE__, __LINE__, file_name, strerror(errno));
+    }
+  }
+  close(fd);
+  Log("Journal: %u records, %u instances, %u edges, pedal %c\n",
+      n_records, rig.n_instances, rig.n_edges, rig.pedal ? rig.pedal : '-');
+  return 0;
+}
+
+// Build `rig` from the mod-host commands `process_modep.pl` wrote to
+// .history, and the connections it made between effects
+void journal_seed(const char * file_name){
+  char line[PATH_MAX + 256];
+  char uri[PATH_MAX], symbol[64];
+  char src[320], dst[320];
+  unsigned instance;
+  float value;
+
+  rig_clear();
+  FILE * fd = fopen(file_name, "r");
+  if(!fd){
+    return;
+  }
+  while(fgets(line, sizeof(line), fd)){
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    uint32_t i;
+    if(sscanf(line, "mod-host add %1023s %u", uri, &instance) == 2){
+      i = instance;
+      memcpy(payload, &i, 4);
+      memcpy(payload + 4, uri, strlen(uri));
+      rig_apply(JOURNAL_INSTANCE, payload, strlen(uri) + 4);
+    }else if(sscanf(line, "mod-host param_set %u %63s %f",
+		    &instance, symbol, &value) == 3){
+      i = instance;
+      memcpy(payload, &i, 4);
+      memcpy(payload + 4, &value, 4);
+      memcpy(payload + 8, symbol, strlen(symbol));
+      rig_apply(JOURNAL_PARAM, payload, strlen(symbol) + 8);
+    }else if(sscanf(line, "mod-host remove %u", &instance) == 1){
+      i = instance;
+      rig_apply(JOURNAL_REMOVE, (uint8_t *)&i, 4);
+    }else if(sscanf(line, "jack %319s %319s", src, dst) == 2 &&
+	     !strncmp(src, "effect_", 7) && !strncmp(dst, "effect_", 7)){
+      // Connections to system ports belong to pedals
+      memcpy(payload, src, strlen(src) + 1);
+      memcpy(payload + strlen(src) + 1, dst, strlen(dst));
+      rig_apply(JOURNAL_EDGE, payload, strlen(src) + strlen(dst) + 1);
+    }
+  }
+  fclose(fd);
+  Log("Journal seeded from %s: %u instances, %u edges\n",
+      file_name, rig.n_instances, rig.n_edges);
+}
+
+// Rewrite the journal as a snapshot of `rig`.  Written to a temporary
+// file that replaces the journal, so there is always a whole journal
+// on disk
+void journal_compact(){
+  char file_name[PATH_MAX], tmp_name[PATH_MAX];
+  assert(snprintf(file_name, PATH_MAX, "%s/.journal", home_dir) < PATH_MAX);
+  assert(snprintf(tmp_name, PATH_MAX, "%s/.journal.tmp",
+		  home_dir) < PATH_MAX);
+
+  int fd = open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd < 0){
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, tmp_name, strerror(errno));
+    return;
+  }
+  uint32_t file_header[2] = {JOURNAL_MAGIC, JOURNAL_VERSION};
+  int ok = write(fd, file_header, sizeof(file_header)) ==
+    sizeof(file_header);
+  uint8_t payload[JOURNAL_MAX_PAYLOAD];
+  for(unsigned i = 0; ok && i < rig.n_instances; i++){
+    struct rig_instance * ri = &rig.instances[i];
+    uint32_t instance = ri->instance;
+    unsigned len = strlen(ri->uri);
+    memcpy(payload, &instance, 4);
+    memcpy(payload + 4, ri->uri, len);
+    ok = journal_write(fd, JOURNAL_INSTANCE, payload, len + 4) > 0;
+    if(ok && ri->port){
+      uint32_t port = ri->port;
+      memcpy(payload + 4, &port, 4);
+      ok = journal_write(fd, JOURNAL_MOD_HOST, payload, 8) > 0;
+    }
+    for(unsigned j = 0; ok && j < ri->n_params; j++){
+      len = strlen(ri->params[j].symbol);
+      memcpy(payload + 4, &ri->params[j].value, 4);
+      memcpy(payload + 8, ri->params[j].symbol, len);
+      ok = journal_write(fd, JOURNAL_PARAM, payload, len + 8) > 0;
+    }
+  }
+  for(unsigned i = 0; ok && i < rig.n_edges; i++){
+    unsigned ls = strlen(rig.edges[i].src), ld = strlen(rig.edges[i].dst);
+    memcpy(payload, rig.edges[i].src, ls + 1);
+    memcpy(payload + ls + 1, rig.edges[i].dst, ld);
+    ok = journal_write(fd, JOURNAL_EDGE, payload, ls + ld + 1) > 0;
+  }
+  if(ok && rig.pedal){
+    ok = journal_write(fd, JOURNAL_PEDAL, (uint8_t *)&rig.pedal, 1) > 0;
+  }
+  for(char p = 'A'; ok && p <= 'C'; p++){
+    unsigned len = strlen(rig.links[p - 'A']);
+    if(len){
+      payload[0] = p;
+      memcpy(payload + 1, rig.links[p - 'A'], len);
+      ok = journal_write(fd, JOURNAL_LINK, payload, len + 1) > 0;
+    }
+  }
+  if(!ok || fsync(fd) < 0 || close(fd) < 0 ||
+     rename(tmp_name, file_name) < 0){
+    Log("%s:%d: Failed to compact journal. Error %s\n",
+	__FILE__, __LINE__, strerror(errno));
+    unlink(tmp_name);
+    return;
+  }
+
+  if(journal.fd >= 0){
+    close(journal.fd);
+  }
+  journal.fd = open(file_name, O_WRONLY|O_APPEND);
+  if(journal.fd < 0){
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+  }
+  journal.appended = 0;
+}
+
+// Called on start up.  Load the journal, or seed it from .history if
+// `EffectsStart` has run since it was written.  Returns 1 if the rig
+// came from the journal and needs to be replayed
+int initialise_journal(){
+  char journal_fn[PATH_MAX], history_fn[PATH_MAX];
+  struct stat js, hs;
+  int replay = 0;
+
+  assert(snprintf(journal_fn, PATH_MAX, "%s/.journal",
+		  home_dir) < PATH_MAX);
+  assert(snprintf(history_fn, PATH_MAX, "%s/.history",
+		  home_dir) < PATH_MAX);
+  int have_journal = stat(journal_fn, &js) == 0;
+  int have_history = stat(history_fn, &hs) == 0;
+  int history_newer = have_history &&
+    (!have_journal || hs.st_mtim.tv_sec > js.st_mtim.tv_sec ||
+     (hs.st_mtim.tv_sec == js.st_mtim.tv_sec &&
+      hs.st_mtim.tv_nsec > js.st_mtim.tv_nsec));
+  if(have_journal && !history_newer && journal_load(journal_fn) == 0){
+    replay = 1;
+    journal_restore_links();
+  }else{
+    journal_seed(history_fn);
+  }
+  journal_compact();
+  return replay;
+}
+
+// Put the effects and their parameters in `rig` into mod-host, and
+// connect the effects to each other.  Effects that are already there
+// are left alone (mod-host responds ERR_INSTANCE_ALREADY_EXISTS).
+// Returns 0 on success, -1 if mod-host is not there
+int journal_replay(){
+  char cmd[PATH_MAX + 128];
+  uint64_t start = now_usec();
+  for(unsigned i = 0; i < rig.n_instances; i++){
+    struct rig_instance * ri = &rig.instances[i];
+    struct mod_host * mh = mod_host_on(ri->port);
+    snprintf(cmd, sizeof(cmd), "add %s %u", ri->uri, ri->instance);
+    if(mod_host_command(mh, cmd) == MOD_HOST_LOST){
+      return -1;
+    }
+    for(unsigned j = 0; j < ri->n_params; j++){
+      snprintf(cmd, sizeof(cmd), "param_set %u %s %f",
+	       ri->instance, ri->params[j].symbol, ri->params[j].value);
+      if(mod_host_command(mh, cmd) == MOD_HOST_LOST){
+	return -1;
+      }
+    }
+  }
+  for(unsigned i = 0; i < rig.n_edges; i++){
+    const char * src = rig.edges[i].src, * dst = rig.edges[i].dst;
+    if(!connected(src, dst)){
+      int r = jack_connect(CLIENT, src, dst);
+      if(r != 0 && r != EEXIST){
+	Log("%s:%d: Failed to connect %s to %s. Error %d\n",
+	    __FILE__, __LINE__, src, dst, r);
+      }
+    }
+  }
+  Log("Replayed %u instances and %u edges in %lu usec\n",
+      rig.n_instances, rig.n_edges, (unsigned long)(now_usec() - start));
+  return 0;
+}
+
+//+===========+++++========++++++=================
+// Reconcile
+//
+// Pedal files can declare the effects they use with mod-host
+// commands: `add <uri> <instance>` and `param_set <instance> <symbol>
+// <value>`.  When they do the driver does not need a fresh mod-host
+// with every board in it.  It looks at what mod-host and JACK already
+// have and sends only the commands needed to get to what the pedals
+// want.  Every board file in PEDALS is wanted, not only the three in
+// the bank.  Instances no file declares are removed, missing ones
+// added, and parameters that differ set.  The connections between
+// effects inside a board (`jack <src> <dst>` lines) are made.
+// Connections between effects and system ports that the selected
+// pedal does not have are broken.
+// Connections to other clients are left alone.
+//
+// mod-host cannot be asked what plugin an instance is, or which
+// mod-host has it, so that comes from the journal.  An instance the
+// journal does not know, or that a pedal file has moved to another
+// mod-host, is removed and added again.
+
+// mod-host prints parameter values with limited precision
+#define RECONCILE_EPSILON 1e-4
+
+// mod-host's MAX_PLUGIN_INSTANCES
+#define MAX_INSTANCES 10000
+
+struct ReconcileResult {
+  unsigned added;
+  unsigned removed;
+  unsigned param_set;
+  unsigned param_same;
+  unsigned connected;
+  unsigned disconnected;
+};
+
+// The instances mod-host has, from the names of JACK clients
+// ("effect_<instance>").  Returns how many, up to `max`
+unsigned running_instances(unsigned * instances, unsigned max){
+  unsigned n = 0;
+  const char ** ports = jack_get_ports(CLIENT, "^effect_", NULL, 0);
+  for(unsigned i = 0; ports && ports[i]; i++){
+    unsigned instance, j;
+    if(sscanf(ports[i], "effect_%u:", &instance) != 1){
+      continue;
+    }
+    for(j = 0; j < n && instances[j] != instance; j++)
+      ;
+    if(j == n && n < max){
+      instances[n++] = instance;
+    }
+  }
+  jack_free(ports);
+  return n;
+}
+
+// The mod-host `instance` is in: Where the journal says it is, else
+// where the pedal files want it
+struct mod_host * mod_host_for(unsigned instance){
+  struct rig_instance * ri = rig_instance(instance);
+  if(ri){
+    return mod_host_on(ri->port);
+  }
+  struct pedal_effect * pe = declared_effect(instance);
+  return mod_host_on(pe ? pe->port : MOD_HOST_PORT);
+}
+
+// Make parameter `symbol` of `instance` `value`.  If `check` ask
+// mod-host first and leave it if it is already there.  Returns 0, or
+// -1 if mod-host is lost
+int reconcile_param(unsigned instance, const char * symbol, float value,
+		    int check, struct ReconcileResult * rr){
+  char cmd[256];
+  struct mod_host * mh = mod_host_for(instance);
+  if(check){
+    snprintf(cmd, sizeof(cmd), "param_get %u %s", instance, symbol);
+    int r = mod_host_command(mh, cmd);
+    if(r == MOD_HOST_LOST){
+      return -1;
+    }
+    if(r >= 0 && fabsf(mh->value - value) <=
+       RECONCILE_EPSILON * (fabsf(value) > 1 ? fabsf(value) : 1)){
+      rr->param_same++;
+      journal_param(instance, symbol, value);
+      return 0;
+    }
+  }
+  snprintf(cmd, sizeof(cmd), "param_set %u %s %f", instance, symbol, value);
+  if(mod_host_command(mh, cmd) == MOD_HOST_LOST){
+    return -1;
+  }
+  journal_param(instance, symbol, value);
+  rr->param_set++;
+  return 0;
+}
+
+// Set the parameters of effect `pe`.  `ri` is what the journal has
+// for it, or NULL.  If `keep_tweaks` values in the journal (set with
+// an expression pedal, say) win over the pedal file.  Returns 0, or
+// -1 if mod-host is lost
+int reconcile_params(struct pedal_effect * pe, struct rig_instance * ri,
+		     int keep_tweaks, int check,
+		     struct ReconcileResult * rr){
+  // Copy of the journal's parameters as `journal_param` changes them
+  unsigned n_rig = ri && keep_tweaks ? ri->n_params : 0;
+  struct rig_param * rp = NULL;
+  if(n_rig){
+    rp = malloc(n_rig * sizeof(struct rig_param));
+    assert(rp);
+    memcpy(rp, ri->params, n_rig * sizeof(struct rig_param));
+  }
+  int r = 0;
+  for(unsigned i = 0; r == 0 && i < pe->n_params; i++){
+    float value = pe->params[i].value;
+    for(unsigned j = 0; j < n_rig; j++){
+      if(!strcmp(rp[j].symbol, pe->params[i].symbol)){
+	value = rp[j].value;
+	rp[j].symbol[0] = '\0'; // Done
+      }
+    }
+    r = reconcile_param(pe->instance, pe->params[i].symbol, value,
+			check, rr);
+  }
+  for(unsigned j = 0; r == 0 && j < n_rig; j++){
+    if(rp[j].symbol[0]){
+      r = reconcile_param(pe->instance, rp[j].symbol, rp[j].value,
+			  check, rr);
+    }
+  }
+  free(rp);
+  return r;
+}
+
+// Does any pedal have the connection `src` -> `dst`?
+int pedals_have(const char * src, const char * dst){
+  for(char p = 'A'; p <= 'C'; p++){
+    if(pedal_has(get_pedal_config(p), src, dst)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Break connections to system ports that `pedal` does not have, and
+// connections between effects that another pedal has and `pedal`
+// does not (the switch engine would have broken them).  Connections
+// between effects that no pedal has were made when the effects were
+// set up, and are left alone.  Returns how many were broken
+unsigned reconcile_edges(char pedal){
+  unsigned n = 0;
+  struct pedal_config * pc = get_pedal_config(pedal);
+  const char ** ports = jack_get_ports(CLIENT, "^(effect_|system:)", NULL,
+				       JackPortIsOutput);
+  for(unsigned i = 0; ports && ports[i]; i++){
+    jack_port_t * port = jack_port_by_name(CLIENT, ports[i]);
+    const char ** dsts = port ? jack_port_get_all_connections(CLIENT, port)
+      : NULL;
+    for(unsigned j = 0; dsts && dsts[j]; j++){
+      int system = !strncmp(ports[i], "system:", 7) ||
+	!strncmp(dsts[j], "system:", 7);
+      if((strncmp(dsts[j], "effect_", 7) &&
+	  strncmp(dsts[j], "system:", 7)) ||
+	 pedal_has(pc, ports[i], dsts[j]) ||
+	 (!system && !pedals_have(ports[i], dsts[j]))){
+	continue;
+      }
+      uint64_t t = now_usec();
+      int r = jack_disconnect(CLIENT, ports[i], dsts[j]);
+      trace_jack(TRACE_OP_DISCONNECT, r, t, ports[i], dsts[j]);
+      if(r == 0){
+	n++;
+      }else{
+	Log("%s:%d: Failed to disconnect %s -> %s: %d\n",
+	    __FILE__, __LINE__, ports[i], dsts[j], r);
+      }
+    }
+    jack_free(dsts);
+  }
+  jack_free(ports);
+  return n;
+}
+
+// Make the connections between effects inside a board (`jack` lines)
+// that are missing, and journal them.  JACK drops every connection an
+// effect has when mod-host deactivates it, and will not connect it
+// while it is deactivated, so edges of sleeping effects are left
+// until they are woken (see `idle_wake`).  Returns how many were made
+unsigned connect_internal(struct pedal_config * pc){
+  unsigned n = 0;
+  for(unsigned i = 0; i < pc->n_internal; i++){
+    const char * src = pc->internal[i].ports[0];
+    const char * dst = pc->internal[i].ports[1];
+    unsigned a, b;
+    if((sscanf(src, "effect_%u:", &a) == 1 && idle_asleep(a)) ||
+       (sscanf(dst, "effect_%u:", &b) == 1 && idle_asleep(b))){
+      continue;
+    }
+    if(!connected(src, dst)){
+      uint64_t t = now_usec();
+      int r = jack_connect(CLIENT, src, dst);
+      trace_jack(TRACE_OP_CONNECT, r, t, src, dst);
+      if(r != 0 && r != EEXIST){
+	Log("%s:%d: Failed to connect %s -> %s: %d\n",
+	    __FILE__, __LINE__, src, dst, r);
+	continue;
+      }
+      n++;
+    }
+    journal_edge(src, dst);
+  }
+  return n;
+}
+
+// Bring mod-host and JACK to what the pedal files declare.  `pedal`
+// is the selected pedal ('\0' if none).  `keep_tweaks` is set on
+// start up and when mod-host comes back, when the journal has the
+// values that were last used, and clear when the pedal files have
+// been edited (SIGHUP).  If no pedal file declares effects fall back
+// to replaying the journal.  Returns 0, or -1 if mod-host is lost
+int reconcile(char pedal, int keep_tweaks){
+  if(!declared_effects()){
+    return keep_tweaks ? journal_replay() : 0;
+  }
+  struct ReconcileResult rr;
+  memset(&rr, 0, sizeof(rr));
+  uint64_t start = now_usec();
+  char cmd[PATH_MAX + 128];
+
+  unsigned running[MAX_INSTANCES];
+  unsigned n_running = running_instances(running, MAX_INSTANCES);
+
+  // Remove what is not wanted, or is not known to be the right plugin
+  // in the right mod-host
+  for(unsigned i = 0; i < n_running; i++){
+    struct pedal_effect * pe = declared_effect(running[i]);
+    struct rig_instance * ri = rig_instance(running[i]);
+    if(pe && ri && ri->uri && !strcmp(ri->uri, pe->uri) &&
+       (ri->port ? ri->port : MOD_HOST_PORT) == pe->port){
+      continue;
+    }
+    snprintf(cmd, sizeof(cmd), "remove %u", running[i]);
+    for(unsigned h = 0; h < n_mod_hosts; h++){
+      // Not knowing where it is, try them all
+      if((!ri || mod_host_for(running[i]) == &mod_hosts[h]) &&
+	 mod_host_command(&mod_hosts[h], cmd) == MOD_HOST_LOST){
+	return -1;
+      }
+    }
+    journal_remove(running[i]);
+    rr.removed++;
+    running[i] = (unsigned)-1; // Gone
+  }
+
+  // The journal forgets what is in neither
+  for(unsigned i = 0; i < rig.n_instances; i++){
+    unsigned instance = rig.instances[i].instance, j;
+    for(j = 0; j < n_running && running[j] != instance; j++)
+      ;
+    if(j == n_running && !declared_effect(instance)){
+      journal_remove(instance);
+      i = -1; // `rig.instances` changed
+    }
+  }
+
+  // Add what is missing and set parameters that differ.  Every board
+  // is wanted, not only the three in the bank
+  struct pedal_config * pcs[4] = {&pedals.pedal_configA,
+				  &pedals.pedal_configB,
+				  &pedals.pedal_configC, &boards};
+  for(unsigned c = 0; c < 4; c++){
+    struct pedal_config * pc = pcs[c];
+    for(unsigned i = 0; i < pc->n_effects; i++){
+      struct pedal_effect * pe = &pc->effects[i];
+      if(declared_effect(pe->instance) != pe){
+	// Declared by an earlier pedal or board too
+	if(strcmp(declared_effect(pe->instance)->uri, pe->uri)){
+	  Log("%s:%d: Instance %u is %s elsewhere.  Ignored\n",
+	      __FILE__, __LINE__, pe->instance,
+	      declared_effect(pe->instance)->uri);
+	}
+	continue;
+      }
+      unsigned j;
+      for(j = 0; j < n_running && running[j] != pe->instance; j++)
+	;
+      int present = j < n_running;
+      struct rig_instance * ri = rig_instance(pe->instance);
+      if(!present){
+	snprintf(cmd, sizeof(cmd), "add %s %u", pe->uri, pe->instance);
+	int r = mod_host_command(mod_host_on(pe->port), cmd);
+	if(r == MOD_HOST_LOST){
+	  return -1;
+	}
+	if(r < 0){
+	  continue; // Logged by `mod_host_read`
+	}
+	if(!ri || !ri->uri || strcmp(ri->uri, pe->uri)){
+	  journal_instance(pe->instance, pe->uri);
+	}
+	journal_mod_host(pe->instance, pe->port);
+	ri = rig_instance(pe->instance);
+	rr.added++;
+      }
+      if(reconcile_params(pe, ri, keep_tweaks, present, &rr) < 0){
+	return -1;
+      }
+    }
+  }
+
+  // Connect the effects inside the boards
+  for(unsigned c = 0; c < 4; c++){
+    rr.connected += connect_internal(pcs[c]);
+  }
+
+  if(pedal){
+    rr.disconnected = reconcile_edges(pedal);
+  }
+  Log("Reconciled: %u added %u removed %u params set %u unchanged "
+      "%u connected %u disconnected in %lu usec\n", rr.added, rr.removed,
+      rr.param_set, rr.param_same, rr.connected, rr.disconnected,
+      (unsigned long)(now_usec() - start));
+  return 0;
+}
+
+//+===========+++++========++++++=================
+// Idle effects
+//
+// Every effect in mod-host costs DSP time whether or not the selected
+// pedal uses it.  Effects the selected pedal does not use are put to
+// sleep:
+//
+// * Effects of the pedals next to the selected one in the bank (the
+//   likely next press) are kept warm: active but bypassed, so
+//   mod-host copies their input to their output without running the
+//   plugin.  Waking them is one `bypass` command
+//
+// * Everything else is cold: deactivated (`activate <instance> 0`),
+//   which costs nothing.  If mod-host does not know `activate` they
+//   are bypassed instead
+//
+// The effects of a pedal are woken before it is connected, the rest
+// are put to sleep after.  A little after each change the DSP load
+// JACK reports before and after is logged.  `driver -I` turns this
+// off
+
+// Wait this long for JACK's DSP load to settle before reporting it
+#define IDLE_SETTLE_USEC 2000000
+
+enum idle_state {
+  IDLE_HOT = 0, // Running
+  IDLE_WARM = 1, // Bypassed
+  IDLE_COLD = 2, // Deactivated, or bypassed
+  IDLE_UNKNOWN = 3, // Not known.  mod-host restarted, say
+};
+
+struct idle_effect {
+  unsigned instance;
+  enum idle_state state;
+  int deactivated;
+};
+
+struct Idle {
+  int enabled;
+
+  // The effects mod-host has and what they were last put in
+  struct idle_effect * effects;
+  unsigned n_effects;
+
+  // -1 until mod-host has been asked to `activate`, then 1 if it can
+  int can_activate;
+
+  // DSP load before the last change and when to report it.  0 if
+  // there is nothing to report
+  float load_before;
+  uint64_t report_at;
+
+  // How long waking the effects of the last pedal selected took.
+  // The switch is not heard until they are awake
+  uint64_t wake_usec;
+
+  // Set when a switch was put off because the effects could not be
+  // woken: the pedal that is still connected (NULL for none)
+  int deferred;
+  char * deferred_from;
+};
+struct Idle idle = {1, NULL, 0, -1, 0, 0, 0, 0, NULL};
+
+// Does `pedal` use effect `instance`?  Either it declares it or it
+// is connected to it
+int pedal_uses(char pedal, unsigned instance){
+  struct pedal_config * pc = get_pedal_config(pedal);
+  for(unsigned i = 0; i < pc->n_effects; i++){
+    if(pc->effects[i].instance == instance){
+      return 1;
+    }
+  }
+  for(unsigned i = 0; i < pc->n_connections + pc->n_internal; i++){
+    struct jack_connection * jc = i < pc->n_connections ?
+      &pc->connections[i] : &pc->internal[i - pc->n_connections];
+    for(unsigned j = 0; j < 2; j++){
+      unsigned n;
+      if(jc->ports[j] &&
+	 sscanf(jc->ports[j], "effect_%u:", &n) == 1 && n == instance){
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// What effect `instance` should be in when `pedal` is selected
+enum idle_state idle_want(char pedal, unsigned instance){
+  if(pedal_uses(pedal, instance)){
+    return IDLE_HOT;
+  }
+  if((pedal > 'A' && pedal_uses(pedal - 1, instance)) ||
+     (pedal < 'C' && pedal_uses(pedal + 1, instance))){
+    return IDLE_WARM;
+  }
+  return IDLE_COLD;
+}
+
+// Forget what state effects are in.  The next `idle_apply` sets them
+// all
+void idle_forget(){
+  for(unsigned i = 0; i < idle.n_effects; i++){
+    idle.effects[i].state = IDLE_UNKNOWN;
+    idle.effects[i].deactivated = 1;
+  }
+}
+
+// Send the commands to put `ie` in `state`.  Does not wait for the
+// responses.  Returns 0, or -1 if mod-host is lost
+int idle_set(struct idle_effect * ie, enum idle_state state){
+  struct mod_host * mh = mod_host_for(ie->instance);
+  char cmd[64];
+  if(state == IDLE_COLD && idle.can_activate){
+    snprintf(cmd, sizeof(cmd), "activate %u 0", ie->instance);
+    if(idle.can_activate < 0){
+      // Find out if mod-host knows `activate`
+      int r = mod_host_command(mh, cmd);
+      if(r == MOD_HOST_LOST){
+	return -1;
+      }
+      idle.can_activate = r >= 0;
+      if(!idle.can_activate){
+	Log("%s:%d: mod-host cannot deactivate effects.  Bypassing\n",
+	    __FILE__, __LINE__);
+      }
+    }else if(mod_host_send(mh, cmd) < 0){
+      return -1;
+    }
+    if(idle.can_activate){
+      ie->deactivated = 1;
+      ie->state = state;
+      return 0;
+    }
+  }
+  if(ie->deactivated){
+    snprintf(cmd, sizeof(cmd), "activate %u 1", ie->instance);
+    if(idle.can_activate && mod_host_send(mh, cmd) < 0){
+      return -1;
+    }
+    ie->deactivated = 0;
+  }
+  snprintf(cmd, sizeof(cmd), "bypass %u %d", ie->instance,
+	   state == IDLE_HOT ? 0 : 1);
+  if(mod_host_send(mh, cmd) < 0){
+    return -1;
+  }
+  ie->state = state;
+  return 0;
+}
+
+// Wait for every mod-host to respond.  Returns 0, or -1 if one is lost
+int idle_drain(){
+  int r = 0;
+  for(unsigned i = 0; i < n_mod_hosts; i++){
+    if(mod_hosts[i].in_flight > 0 &&
+       mod_host_wait(&mod_hosts[i], "activate/bypass") == MOD_HOST_LOST){
+      r = -1;
+    }
+  }
+  return r;
+}
+
+// Rebuild the table from what mod-host has now.  New effects are in
+// an unknown state
+void idle_scan(){
+  unsigned running[MAX_INSTANCES];
+  unsigned n_running = running_instances(running, MAX_INSTANCES);
+  struct idle_effect * effects = malloc((n_running ? n_running : 1) *
+					sizeof(struct idle_effect));
+  assert(effects);
+  for(unsigned i = 0; i < n_running; i++){
+    effects[i].instance = running[i];
+    effects[i].state = IDLE_UNKNOWN;
+    effects[i].deactivated = 1;
+    for(unsigned j = 0; j < idle.n_effects; j++){
+      if(idle.effects[j].instance == running[i]){
+	effects[i] = idle.effects[j];
+	break;
+      }
+    }
+  }
+  free(idle.effects);
+  idle.effects = effects;
+  idle.n_effects = n_running;
+}
+
+// Wake the effects `pedal` uses, before it is connected.  Returns 0,
+// or -1 if mod-host is lost
+int idle_wake(char pedal){
+  if(!idle.enabled){
+    return 0;
+  }
+  if(!idle.n_effects){
+    // The first wake.  A driver before this one, or the stress test,
+    // may have left effects deactivated
+    idle_scan();
+  }
+  int activated = 0;
+  for(unsigned i = 0; i < idle.n_effects; i++){
+    struct idle_effect * ie = &idle.effects[i];
+    if(ie->state != IDLE_HOT && pedal_uses(pedal, ie->instance)){
+      activated |= ie->deactivated;
+      if(idle_set(ie, IDLE_HOT) < 0){
+	return -1;
+      }
+    }
+  }
+  if(idle_drain() < 0){
+    return -1;
+  }
+  if(activated){
+    // Deactivating dropped the connections inside the board.
+    // `implement_pedal` only makes those to system ports
+    connect_internal(get_pedal_config(pedal));
+  }
+  return 0;
+}
+
+// Is effect `instance` known to be deactivated?
+int idle_asleep(unsigned instance){
+  for(unsigned i = 0; i < idle.n_effects; i++){
+    if(idle.effects[i].instance == instance){
+      return idle.effects[i].state == IDLE_COLD &&
+	idle.effects[i].deactivated;
+    }
+  }
+  return 0;
+}
+
+// Put every effect mod-host has in the state it should be in with
+// `pedal` selected.  Returns 0, or -1 if mod-host is lost
+int idle_apply(char pedal){
+  if(!idle.enabled){
+    return 0;
+  }
+  idle_scan();
+
+  unsigned changed = 0, count[3] = {0, 0, 0};
+  int activated = 0;
+  float load = jack_cpu_load(CLIENT);
+  for(unsigned i = 0; i < idle.n_effects; i++){
+    struct idle_effect * ie = &idle.effects[i];
+    enum idle_state want = idle_want(pedal, ie->instance);
+    count[want]++;
+    if(ie->state != want){
+      int was_deactivated = ie->deactivated;
+      if(idle_set(ie, want) < 0){
+	return -1;
+      }
+      activated |= was_deactivated && !ie->deactivated;
+      changed++;
+    }
+  }
+  if(idle_drain() < 0){
+    return -1;
+  }
+  if(activated){
+    // Warm effects that were deactivated lost their connections
+    for(char p = 'A'; p <= 'C'; p++){
+      connect_internal(get_pedal_config(p));
+    }
+  }
+  if(changed){
+#ifdef VERBOSE
+    Log("Idle %c: %u hot %u warm %u cold.  %u changed\n", pedal,
+	count[IDLE_HOT], count[IDLE_WARM], count[IDLE_COLD], changed);
+#endif
+    if(!idle.report_at){
+      idle.load_before = load;
+    }
+    idle.report_at = now_usec() + IDLE_SETTLE_USEC;
+  }
+  return 0;
+}
+
+// The stress test and the latency probe run instead of the driver.
+// Put effects to sleep and wake them as the driver does, if mod-host
+// is there
+void idle_standalone(){
+  if(idle.enabled && mod_hosts_connect() < 0){
+    Log("mod-host is not there.  Effects are not put to sleep\n");
+    idle.enabled = 0;
+  }
+}
+
+// When the stress test or the latency probe finishes leave every
+// effect running, with the connections inside its board, as the
+// driver that starts next expects
+void idle_restore(){
+  if(!idle.enabled){
+    return;
+  }
+  idle_scan();
+  for(unsigned i = 0; i < idle.n_effects; i++){
+    if(idle.effects[i].state != IDLE_HOT &&
+       idle_set(&idle.effects[i], IDLE_HOT) < 0){
+      return;
+    }
+  }
+  if(idle_drain() < 0){
+    return;
+  }
+  for(char p = 'A'; p <= 'C'; p++){
+    connect_internal(get_pedal_config(p));
+  }
+  connect_internal(&boards);
+}
+
+// Switch pedals, waking the effects of `new_pedal` first and putting
+// the others to sleep after.  If they cannot be woken mod-host is lost
+// and the switch is put off, rather than connect a chain that may be
+// asleep.  The driver calls this again (`old_pedal` NULL) when
+// mod-host is back, and the pedal still connected is disconnected
+// then.  Returns what `change_pedal` does, or 1 if the switch was put
+// off
+int idle_change_pedal(char * old_pedal, char * new_pedal){
+  if(idle.deferred){
+    old_pedal = idle.deferred_from;
+    idle.deferred = 0;
+  }
+  uint64_t start = now_usec();
+  if(new_pedal && idle_wake(*new_pedal) < 0){
+    Log("%s:%d: Cannot wake the effects of %c.  mod-host lost.  "
+	"Switch put off\n", __FILE__, __LINE__, *new_pedal);
+    idle.deferred = 1;
+    idle.deferred_from = old_pedal;
+    return 1;
+  }
+  idle.wake_usec = now_usec() - start;
+  int r = change_pedal(old_pedal, new_pedal);
+  if(r == 0 && new_pedal){
+    idle_apply(*new_pedal);
+  }
+  return r;
+}
+
+// Log the DSP load saved by the last change once it has settled.
+// Returns how long until then in usec, or -1 if nothing is waiting
+long idle_report(){
+  if(!idle.report_at){
+    return -1;
+  }
+  uint64_t now = now_usec();
+  if(now < idle.report_at){
+    return idle.report_at - now;
+  }
+  unsigned count[4] = {0, 0, 0, 0};
+  for(unsigned i = 0; i < idle.n_effects; i++){
+    count[idle.effects[i].state]++;
+  }
+  float load = jack_cpu_load(CLIENT);
+  Log("Idle: %u hot %u warm %u cold.  DSP load %.1f%% -> %.1f%%: "
+      "%.1f%% saved\n", count[IDLE_HOT], count[IDLE_WARM],
+      count[IDLE_COLD], idle.load_before, load, idle.load_before - load);
+  idle.report_at = 0;
+  return -1;
+}
+
+//+===========+++++========++++++=================
+// Stress test
+//
+// `driver -s <switches> [-m]` presses pedals at random, as fast as
+// the switch engine will go, and reloads the pedals (as if sent
+// SIGHUP) now and then.  After every switch the connections JACK has
+// are checked against what the selected pedal should have.  With -m
+// a second JACK client ("stress_mutator", in a child process)
+// connects and disconnects its own ports to everything it can find,
+// registers and unregisters ports, and breaks the pedals' own
+// connections for a moment while the test runs.  Each switch puts
+// back what the new pedal needs, so a break the check sees before the
+// next switch counts as a divergence.
+//
+// Run it instead of the driver, not with it.  It does not touch
+// mod-host, the journal or PEDALS/.PEDAL
+
+// One in this many switches is followed by a reload
+#define STRESS_RELOAD_ODDS 50
+
+// How many ports the mutator registers of each direction
+#define STRESS_MUTATOR_PORTS 4
+
+struct StressResult {
+  unsigned switches;
+  unsigned reloads;
+  unsigned failures; // implement/deimplement_pedal returned an error
+  unsigned divergences; // Switches after which the graph was wrong
+  unsigned missing; // Connections the pedal needs that were not there
+  unsigned extra; // Connections to system ports that should be gone
+  unsigned stale; // Internal connections of other pedals left behind
+};
+
+// Compare the connections JACK has with those `pedal` should have.
+// Every connection of `pedal` must be there.  Connections of the
+// other pedals that are not in `pedal` and go to or from a system
+// port must not be.  Connections between effects of other pedals
+// carry no sound and are counted as stale.  Returns the number of
+// wrong connections
+unsigned check_graph(char pedal, struct StressResult * sr){
+  const struct pedal_config * pc = get_pedal_config(pedal);
+  unsigned wrong = 0;
+  for(unsigned i = 0; i < pc->n_connections; i++){
+    if(!connected(pc->connections[i].ports[0],
+		  pc->connections[i].ports[1])){
+      Log("%s:%d: Pedal %c missing %s -> %s\n", __FILE__, __LINE__,
+	  pedal, pc->connections[i].ports[0], pc->connections[i].ports[1]);
+      sr->missing++;
+      wrong++;
+    }
+  }
+  // The connections inside the board.  Lost if a wake did not put
+  // them back
+  for(unsigned i = 0; i < pc->n_internal; i++){
+    if(!connected(pc->internal[i].ports[0], pc->internal[i].ports[1])){
+      Log("%s:%d: Pedal %c missing internal %s -> %s\n", __FILE__,
+	  __LINE__, pedal, pc->internal[i].ports[0],
+	  pc->internal[i].ports[1]);
+      sr->missing++;
+      wrong++;
+    }
+  }
+  for(char p = 'A'; p <= 'C'; p++){
+    if(p == pedal){
+      continue;
+    }
+    const struct pedal_config * opc = get_pedal_config(p);
+    for(unsigned i = 0; i < opc->n_connections; i++){
+      const char * src = opc->connections[i].ports[0];
+      const char * dst = opc->connections[i].ports[1];
+      if(pedal_has(pc, src, dst) || !connected(src, dst)){
+	continue;
+      }
+      if(!strncmp(src, "system:", 7) || !strncmp(dst, "system:", 7)){
+	Log("%s:%d: Pedal %c has %c's %s -> %s\n", __FILE__, __LINE__,
+	    pedal, p, src, dst);
+	sr->extra++;
+	wrong++;
+      }else{
+	sr->stale++;
+      }
+    }
+  }
+  return wrong;
+}
+
+// Disconnect a connection, not the mutator's own, between effect and
+// system ports and then put it back
+void stress_break_edge(jack_client_t * client){
+  const char ** outs = jack_get_ports(client, NULL,
+				      JACK_DEFAULT_AUDIO_TYPE,
+				      JackPortIsOutput);
+  unsigned n_outs = 0;
+  while(outs && outs[n_outs]){
+    n_outs++;
+  }
+  const char * src = n_outs ? outs[random() % n_outs] : NULL;
+  jack_port_t * port = src ? jack_port_by_name(client, src) : NULL;
+  const char ** dsts = port ? jack_port_get_all_connections(client, port) :
+    NULL;
+  unsigned n_dsts = 0;
+  while(dsts && dsts[n_dsts]){
+    n_dsts++;
+  }
+  const char * dst = n_dsts ? dsts[random() % n_dsts] : NULL;
+  if(dst && strncmp(src, "stress_mutator:", 15) &&
+     strncmp(dst, "stress_mutator:", 15)){
+    jack_disconnect(client, src, dst);
+    usleep(random() % 2000);
+    jack_connect(client, src, dst);
+  }
+  if(dsts){
+    jack_free(dsts);
+  }
+  if(outs){
+    jack_free(outs);
+  }
+}
+
+// The child process that mutates the graph.  Runs until killed or
+// its parent goes away
+void stress_mutator(){
+  jack_status_t status;
+  jack_client_t * client = jack_client_open("stress_mutator",
+					    JackNoStartServer, &status);
+  if(client == NULL){
+    Log("%s:%d: Mutator failed to open client. Status 0x%x\n",
+	__FILE__, __LINE__, status);
+    exit(1);
+  }
+  jack_port_t * ports[2][STRESS_MUTATOR_PORTS];
+  for(unsigned i = 0; i < STRESS_MUTATOR_PORTS; i++){
+    char name[32];
+    snprintf(name, sizeof(name), "in_%u", i);
+    ports[0][i] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE,
+				     JackPortIsInput, 0);
+    snprintf(name, sizeof(name), "out_%u", i);
+    ports[1][i] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE,
+				     JackPortIsOutput, 0);
+  }
+  if(jack_activate(client)){
+    Log("%s:%d: Mutator failed to activate\n", __FILE__, __LINE__);
+    exit(1);
+  }
+  pid_t parent = getppid();
+  while(getppid() == parent){
+    unsigned i = random() % STRESS_MUTATOR_PORTS;
+    int dir = random() % 2; // 0: Connect something to our input
+    unsigned long flags = dir ? JackPortIsInput : JackPortIsOutput;
+    const char ** others = jack_get_ports(client, NULL,
+					  JACK_DEFAULT_AUDIO_TYPE, flags);
+    unsigned n_others = 0;
+    while(others && others[n_others]){
+      n_others++;
+    }
+    const char * mine = ports[dir][i] ? jack_port_name(ports[dir][i]) : NULL;
+    switch(random() % 5){
+    case 0:
+    case 1:
+      // Connect
+      if(mine && n_others){
+	const char * other = others[random() % n_others];
+	if(dir){
+	  jack_connect(client, mine, other);
+	}else{
+	  jack_connect(client, other, mine);
+	}
+      }
+      break;
+    case 2:
+      // Disconnect everything from one of our ports
+      if(ports[dir][i]){
+	jack_port_disconnect(client, ports[dir][i]);
+      }
+      break;
+    case 3:
+      // Churn a port
+      if(ports[dir][i]){
+	jack_port_unregister(client, ports[dir][i]);
+	ports[dir][i] = NULL;
+      }else{
+	char name[32];
+	snprintf(name, sizeof(name), dir ? "out_%u" : "in_%u", i);
+	ports[dir][i] = jack_port_register(client, name,
+					   JACK_DEFAULT_AUDIO_TYPE,
+					   dir ? JackPortIsOutput :
+					   JackPortIsInput, 0);
+      }
+      break;
+    case 4:
+      // Break one of the pedals' connections
+      stress_break_edge(client);
+      break;
+    }
+    if(others){
+      jack_free(others);
+    }
+    usleep(random() % 2000);
+  }
+  jack_client_close(client);
+  exit(0);
+}
+
+int compare_uint64(const void * a, const void * b){
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// The `p`th percentile of the sorted `v`
+uint64_t percentile(const uint64_t * v, unsigned n, double p){
+  if(n == 0){
+    return 0;
+  }
+  unsigned i = (unsigned)(p / 100.0 * (n - 1) + 0.5);
+  return v[i];
+}
+
+// Run the stress test.  Returns 0 if every switch left the graph
+// right
+int stress(unsigned n_switches, int mutate){
+  jack_status_t status;
+  struct StressResult sr;
+  memset(&sr, 0, sizeof(sr));
+
+  unsigned seed = time(NULL) ^ getpid();
+  srandom(seed);
+  Log("Stress: %u switches. Seed %u.%s\n", n_switches, seed,
+      mutate ? " Mutating the graph" : "");
+
+  // Fork the mutator before this process talks to JACK
+  pid_t mutator = 0;
+  if(mutate){
+    mutator = fork();
+    if(mutator < 0){
+      Log("%s:%d: fork Error %s\n", __FILE__, __LINE__, strerror(errno));
+      return -1;
+    }
+    if(mutator == 0){
+      srandom(seed + 1);
+      stress_mutator();
+    }
+  }
+
+  CLIENT = jack_client_open("stress", JackNoStartServer, &status);
+  if(CLIENT == NULL){
+    Log("%s:%d: jack_client_open() failed, status = 0x%x\n",
+	__FILE__, __LINE__, status);
+    if(mutator > 0){
+      kill(mutator, SIGTERM);
+    }
+    return -1;
+  }
+
+  idle_standalone();
+
+  uint64_t * latency = malloc(n_switches * sizeof(uint64_t));
+  assert(latency);
+  unsigned n_latency = 0;
+  char pedal_names[3] = {'A', 'B', 'C'};
+  char * current_pedal = NULL;
+
+  uint64_t start = now_usec();
+  for(unsigned i = 0; i < n_switches; i++){
+    if(signaled){
+      // Reload, like the driver does when it gets a HUP
+      destroy_pedals();
+      initialise_pedals();
+      signaled = 0;
+      current_pedal = NULL;
+      sr.reloads++;
+    }
+
+    char * old_pedal = current_pedal;
+    current_pedal = &pedal_names[random() % 3];
+
+    // The same switch engine the driver uses, waking the effects
+    int r = idle_change_pedal(old_pedal, current_pedal);
+    sr.switches++;
+    if(r == 1){
+      // Deferred, nothing was switched to time
+      sr.failures++;
+    }else{
+      latency[n_latency++] = idle.wake_usec + switch_stats.last_usec;
+      if(r != 0){
+	sr.failures++;
+      }
+    }
+    if(check_graph(*current_pedal, &sr)){
+      sr.divergences++;
+    }
+    if(random() % STRESS_RELOAD_ODDS == 0){
+      raise(SIGHUP);
+    }
+  }
+  uint64_t elapsed = now_usec() - start;
+
+  if(mutator > 0){
+    kill(mutator, SIGTERM);
+    waitpid(mutator, NULL, 0);
+  }
+  idle_restore();
+  jack_client_close(CLIENT);
+
+  qsort(latency, n_latency, sizeof(uint64_t), compare_uint64);
+  Log("Stress: %u switches %u reloads in %.3f s: %.0f switches/s\n",
+      sr.switches, sr.reloads, elapsed / 1e6,
+      elapsed ? sr.switches * 1e6 / elapsed : 0);
+  Log("Stress: Switch usec p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu "
+      "over %u switches\n",
+      (unsigned long)percentile(latency, n_latency, 50),
+      (unsigned long)percentile(latency, n_latency, 90),
+      (unsigned long)percentile(latency, n_latency, 99),
+      (unsigned long)percentile(latency, n_latency, 99.9),
+      (unsigned long)(n_latency ? latency[n_latency - 1] : 0), n_latency);
+  Log("Stress: Divergences %u (missing %u, extra %u) failures %u "
+      "stale %u\n", sr.divergences, sr.missing, sr.extra, sr.failures,
+      sr.stale);
+  free(latency);
+  return sr.divergences || sr.failures ? 1 : 0;
+}
+
+//+===========+++++========++++++=================
+// Trace
+//
+// `driver -t <file>` records a binary trace of what the driver does,
+// stamped with the monotonic clock: the raw events from the pedal,
+// the pedal configurations, each switch and the connections it plans
+// to make and break, every call to JACK and mod-host with its result,
+// and JACK's graph callbacks.
+//
+// `driver -P <file>` replays a trace.  The pedal configurations in
+// the trace are loaded, JACK clients are made to stand in for any
+// ports that do not exist (so it runs against `jackd -d dummy`), and
+// the switches are fed into the switch engine at the times they were
+// recorded (as fast as possible with -f).  The time each switch took
+// is compared with the recording.  Add -t to trace the replay.
+//
+// The file starts with two u32: TRACE_MAGIC and TRACE_VERSION.  Then
+// every record is a `struct trace_header` followed by `length` bytes
+// of payload.  Pairs of port names are stored as "src\0dst".  Each
+// record is written with one write(2) to a file opened O_APPEND, so
+// records from JACK's callback thread do not interleave with those
+// from the main loop
+
+#define TRACE_MAGIC 0x5450484d // "MHPT"
+#define TRACE_VERSION 1
+
+enum trace_type {
+  TRACE_EVDEV = 1, // u16 type, u16 code, i32 value
+  TRACE_CONFIG = 2, // u8 pedal, ports
+  TRACE_RELOAD = 3, // Pedal configurations destroyed
+  TRACE_SWITCH = 4, // u8 old pedal ('-' for none), u8 new pedal
+  TRACE_PLAN = 5, // u8 op, ports
+  TRACE_JACK = 6, // u8 op, i32 result, u32 usec, ports
+  TRACE_SWITCH_DONE = 7, // i32 result, u32 usec
+  TRACE_MOD_HOST = 8, // Command sent
+  TRACE_MOD_HOST_RESP = 9, // i32 status
+  TRACE_GRAPH_CONNECT = 10, // u8 connected, ports
+  TRACE_GRAPH_ORDER = 11,
+  TRACE_RELOAD_PEDAL = 12, // u8 pedal.  Its configuration is replaced
+			   // by the TRACE_CONFIG records that follow
+  TRACE_RECONNECT = 13, // u8 pedal, u8 connected.  After a
+			// TRACE_RELOAD_PEDAL of the selected pedal
+};
+
+struct trace_header {
+  uint64_t usec;
+  uint16_t type;
+  uint16_t length;
+};
+
+#define TRACE_MAX_PAYLOAD 2048
+
+struct Trace {
+  int fd;
+};
+struct Trace trace = {-1};
+
+int trace_open(const char * file_name){
+  trace.fd = open(file_name, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+  if(trace.fd < 0){
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    return -1;
+  }
+  uint32_t file_header[2] = {TRACE_MAGIC, TRACE_VERSION};
+  if(write(trace.fd, file_header, sizeof(file_header)) !=
+     sizeof(file_header)){
+    Log("%s:%d: Failed to write %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    close(trace.fd);
+    trace.fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+void trace_record_at(uint64_t usec, uint16_t type, const void * payload,
+		     unsigned length){
+  if(trace.fd < 0){
+    return;
+  }
+  uint8_t buf[sizeof(struct trace_header) + TRACE_MAX_PAYLOAD];
+  struct trace_header th;
+  if(length > TRACE_MAX_PAYLOAD){
+    length = TRACE_MAX_PAYLOAD;
+  }
+  th.usec = usec;
+  th.type = type;
+  th.length = length;
+  memcpy(buf, &th, sizeof(th));
+  memcpy(buf + sizeof(th), payload, length);
+  if(write(trace.fd, buf, sizeof(th) + length) < 0){
+    Log("%s:%d: Failed to write trace. Error %s\n",
+	__FILE__, __LINE__, strerror(errno));
+  }
+}
+
+void trace_record(uint16_t type, const void * payload, unsigned length){
+  trace_record_at(now_usec(), type, payload, length);
+}
+
+// Put "src\0dst" into `buf`.  Returns the length
+unsigned trace_ports(uint8_t * buf, unsigned size, const char * src,
+		     const char * dst){
+  unsigned ls = strlen(src), ld = strlen(dst);
+  if(ls + 1 + ld > size){
+    return 0;
+  }
+  memcpy(buf, src, ls + 1);
+  memcpy(buf + ls + 1, dst, ld);
+  return ls + 1 + ld;
+}
+
+void trace_evdev(const struct input_event * ev){
+  if(trace.fd < 0){
+    return;
+  }
+  uint8_t payload[8];
+  uint16_t type = ev->type, code = ev->code;
+  int32_t value = ev->value;
+  memcpy(payload, &type, 2);
+  memcpy(payload + 2, &code, 2);
+  memcpy(payload + 4, &value, 4);
+  // The pedal's clock is set to CLOCK_MONOTONIC, so the time of the
+  // event is comparable with the rest of the trace
+  trace_record_at((uint64_t)ev->time.tv_sec * 1000000 + ev->time.tv_usec,
+		  TRACE_EVDEV, payload, sizeof(payload));
+}
+
+void trace_config(char pedal, const char * src, const char * dst){
+  if(trace.fd < 0){
+    return;
+  }
+  uint8_t payload[TRACE_MAX_PAYLOAD];
+  payload[0] = pedal;
+  unsigned n = trace_ports(payload + 1, TRACE_MAX_PAYLOAD - 1, src, dst);
+  trace_record(TRACE_CONFIG, payload, n + 1);
+}
+
+void trace_reload(){
+  trace_record(TRACE_RELOAD, NULL, 0);
+}
+
+// One pedal is reread on its own.  The other pedals, and the
+// selected one, are unchanged
+void trace_reload_pedal(char pedal){
+  trace_record(TRACE_RELOAD_PEDAL, (uint8_t *)&pedal, 1);
+}
+
+// The selected pedal has been reread and is being switched to what
+// its file has now.  `connected` is clear if the new configuration is
+// left until mod-host is back
+void trace_reconnect(char pedal, int connected){
+  uint8_t payload[2] = {pedal, connected};
+  trace_record(TRACE_RECONNECT, payload, 2);
+}
+
+// Record the switch from `old_pedal` to `new_pedal`, and the plan: the
+// connections of the new pedal that were not in the old, and those of
+// the old that are not in the new
+void trace_switch(char * old_pedal, char * new_pedal){
+  if(trace.fd < 0){
+    return;
+  }
+  uint8_t payload[TRACE_MAX_PAYLOAD];
+  payload[0] = old_pedal ? *old_pedal : '-';
+  payload[1] = *new_pedal;
+  trace_record(TRACE_SWITCH, payload, 2);
+
+  struct pedal_config * npc = get_pedal_config(*new_pedal);
+  struct pedal_config * opc = old_pedal ? get_pedal_config(*old_pedal) : NULL;
+  for(unsigned i = 0; i < npc->n_connections; i++){
+    const char * src = npc->connections[i].ports[0];
+    const char * dst = npc->connections[i].ports[1];
+    if(!opc || !pedal_has(opc, src, dst)){
+      payload[0] = TRACE_OP_CONNECT;
+      unsigned n = trace_ports(payload + 1, sizeof(payload) - 1, src, dst);
+      trace_record(TRACE_PLAN, payload, n + 1);
+    }
+  }
+  for(unsigned i = 0; opc && i < opc->n_connections; i++){
+    const char * src = opc->connections[i].ports[0];
+    const char * dst = opc->connections[i].ports[1];
+    if(!pedal_has(npc, src, dst)){
+      payload[0] = TRACE_OP_DISCONNECT;
+      unsigned n = trace_ports(payload + 1, sizeof(payload) - 1, src, dst);
+      trace_record(TRACE_PLAN, payload, n + 1);
+    }
+  }
+}
+
+// Is `op` on `src` -> `dst` in the plan for switching from
+// `old_pedal` to `new_pedal`, as `trace_switch` records it?  For
+// checking a replay against the recording
+int plan_has(char * old_pedal, char * new_pedal, uint8_t op,
+	     const char * src, const char * dst){
+  struct pedal_config * npc = get_pedal_config(*new_pedal);
+  struct pedal_config * opc = old_pedal ? get_pedal_config(*old_pedal) : NULL;
+  if(op == TRACE_OP_CONNECT){
+    return pedal_has(npc, src, dst) && (!opc || !pedal_has(opc, src, dst));
+  }
+  return opc && pedal_has(opc, src, dst) && !pedal_has(npc, src, dst);
+}
+
+// How many steps are in that plan
+unsigned plan_size(char * old_pedal, char * new_pedal){
+  struct pedal_config * npc = get_pedal_config(*new_pedal);
+  struct pedal_config * opc = old_pedal ? get_pedal_config(*old_pedal) : NULL;
+  unsigned n = 0;
+  for(unsigned i = 0; i < npc->n_connections; i++){
+    n += !opc || !pedal_has(opc, npc->connections[i].ports[0],
+			    npc->connections[i].ports[1]);
+  }
+  for(unsigned i = 0; opc && i < opc->n_connections; i++){
+    n += !pedal_has(npc, opc->connections[i].ports[0],
+		    opc->connections[i].ports[1]);
+  }
+  return n;
+}
+
+void trace_switch_done(int result, uint64_t usec){
+  if(trace.fd < 0){
+    return;
+  }
+  uint8_t payload[8];
+  int32_t r = result;
+  uint32_t u = usec;
+  memcpy(payload, &r, 4);
+  memcpy(payload + 4, &u, 4);
+  trace_record(TRACE_SWITCH_DONE, payload, sizeof(payload));
+}
+
+// A call to JACK that started at `start`
+void trace_jack(int op, int result, uint64_t start, const char * src,
+		const char * dst){
+  if(trace.fd < 0){
+    return;
+  }
+  uint8_t payload[TRACE_MAX_PAYLOAD];
+  int32_t r = result;
+  uint32_t u = now_usec() - start;
+  payload[0] = op;
+  memcpy(payload + 1, &r, 4);
+  memcpy(payload + 5, &u, 4);
+  unsigned n = trace_ports(payload + 9, sizeof(payload) - 9, src, dst);
+  trace_record_at(start, TRACE_JACK, payload, n + 9);
+}
+
+void trace_mod_host(const char * cmd){
+  trace_record(TRACE_MOD_HOST, cmd, strlen(cmd));
+}
+
+void trace_mod_host_resp(int status){
+  int32_t s = status;
+  trace_record(TRACE_MOD_HOST_RESP, &s, 4);
+}
+
+// Called by JACK, in its thread, when ports are connected or
+// disconnected
+void trace_port_connect_cb(jack_port_id_t a, jack_port_id_t b,
+			   int connect, void * arg){
+  uint8_t payload[TRACE_MAX_PAYLOAD];
+  jack_port_t * pa = jack_port_by_id(CLIENT, a);
+  jack_port_t * pb = jack_port_by_id(CLIENT, b);
+  payload[0] = connect;
+  unsigned n = trace_ports(payload + 1, sizeof(payload) - 1,
+			   pa ? jack_port_name(pa) : "?",
+			   pb ? jack_port_name(pb) : "?");
+  trace_record(TRACE_GRAPH_CONNECT, payload, n + 1);
+}
+
+int trace_graph_order_cb(void * arg){
+  trace_record(TRACE_GRAPH_ORDER, NULL, 0);
+  return 0;
+}
+
+// Have JACK tell us about changes to the graph.  The client has to be
+// active for the callbacks to run
+void trace_jack_callbacks(){
+  if(trace.fd < 0){
+    return;
+  }
+  jack_set_port_connect_callback(CLIENT, trace_port_connect_cb, NULL);
+  jack_set_graph_order_callback(CLIENT, trace_graph_order_cb, NULL);
+  if(jack_activate(CLIENT)){
+    Log("%s:%d: Failed to activate JACK client.  No graph callbacks\n",
+	__FILE__, __LINE__);
+  }
+}
+
+// JACK clients standing in for ports that are not there when
+// replaying
+#define MAX_STAND_INS 64
+struct stand_in {
+  char name[128];
+  jack_client_t * client;
+};
+struct stand_in stand_ins[MAX_STAND_INS];
+unsigned n_stand_ins = 0;
+
+// Make sure `port` exists.  If it does not, register it with a client
+// that has the right name
+void replay_stand_in(const char * port, int output){
+  if(jack_port_by_name(CLIENT, port)){
+    return;
+  }
+  const char * colon = strchr(port, ':');
+  if(!colon || colon - port >= sizeof(stand_ins[0].name)){
+    return;
+  }
+  char name[128];
+  memcpy(name, port, colon - port);
+  name[colon - port] = '\0';
+
+  jack_client_t * client = NULL;
+  for(unsigned i = 0; i < n_stand_ins; i++){
+    if(!strcmp(stand_ins[i].name, name)){
+      client = stand_ins[i].client;
+      break;
+    }
+  }
+  if(!client){
+    if(n_stand_ins == MAX_STAND_INS){
+      Log("%s:%d: Too many stand in clients for %s\n",
+	  __FILE__, __LINE__, port);
+      return;
+    }
+    jack_status_t status;
+    client = jack_client_open(name, JackNoStartServer|JackUseExactName,
+			      &status);
+    if(!client || jack_activate(client)){
+      Log("%s:%d: Cannot stand in for %s. Status 0x%x\n",
+	  __FILE__, __LINE__, name, status);
+      return;
+    }
+    strcpy(stand_ins[n_stand_ins].name, name);
+    stand_ins[n_stand_ins++].client = client;
+  }
+  if(!jack_port_register(client, colon + 1, JACK_DEFAULT_AUDIO_TYPE,
+			 output ? JackPortIsOutput : JackPortIsInput, 0)){
+    Log("%s:%d: Failed to register %s\n", __FILE__, __LINE__, port);
+  }
+}
+
+// Replay the trace in `file_name`.  If `fast` do not wait for the
+// recorded time between switches.  Returns 0 if every switch
+// succeeded
+int replay_trace(const char * file_name, int fast){
+  jack_status_t status;
+  int fd = open(file_name, O_RDONLY);
+  if(fd < 0){
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    return -1;
+  }
+  uint32_t file_header[2];
+  if(read(fd, file_header, sizeof(file_header)) != sizeof(file_header) ||
+     file_header[0] != TRACE_MAGIC || file_header[1] != TRACE_VERSION){
+    Log("%s:%d: %s is not a trace\n", __FILE__, __LINE__, file_name);
+    close(fd);
+    return -1;
+  }
+
+  CLIENT = jack_client_open("replay", JackNoStartServer, &status);
+  if(CLIENT == NULL){
+    Log("%s:%d: jack_client_open() failed, status = 0x%x\n",
+	__FILE__, __LINE__, status);
+    close(fd);
+    return -1;
+  }
+  trace_jack_callbacks();
+
+  // The configurations come from the trace
+  memset(&pedals, 0, sizeof(pedals));
+
+  char pedal_names[3] = {'A', 'B', 'C'};
+  char * current_pedal = NULL;
+
+  // The configuration of a pedal before a TRACE_RELOAD_PEDAL
+  struct pedal_config reloaded;
+  memset(&reloaded, 0, sizeof(reloaded));
+
+  uint64_t trace_start = 0, start = now_usec();
+  uint64_t replayed_usec = 0;
+  uint64_t recorded_total = 0, replayed_total = 0;
+  uint64_t recorded_max = 0, replayed_max = 0;
+  unsigned switches = 0, failures = 0, recorded_failures = 0;
+  unsigned jack_failures = 0, mod_host_skipped = 0, n_events = 0;
+  int result = 0;
+
+  // The switch being replayed, for checking its TRACE_PLAN records
+  char * plan_old = NULL, * plan_new = NULL;
+  unsigned plan_replayed = 0, plan_recorded = 0, plan_mismatches = 0;
+
+  for(;;){
+    struct trace_header th;
+    uint8_t payload[TRACE_MAX_PAYLOAD + 1];
+    if(read(fd, &th, sizeof(th)) != sizeof(th) ||
+       th.length > TRACE_MAX_PAYLOAD ||
+       read(fd, payload, th.length) != th.length){
+      break;
+    }
+    payload[th.length] = '\0';
+    if(!trace_start){
+      trace_start = th.usec;
+    }
+    // The ports in a TRACE_CONFIG or TRACE_PLAN
+    const char * src = NULL, * dst = NULL;
+
+    switch(th.type){
+    case TRACE_EVDEV:
+      n_events++;
+      break;
+
+    case TRACE_CONFIG:
+      src = (char *)payload + 1;
+      dst = src + strlen(src) + 1;
+      if(payload[0] < 'A' || payload[0] > 'C' ||
+	 dst > (char *)payload + th.length){
+	break;
+      }
+      replay_stand_in(src, 1);
+      replay_stand_in(dst, 0);
+      add_pedal_effect(payload[0], src, dst);
+      break;
+
+    case TRACE_RELOAD:
+      // The driver keeps the selected pedal
+      destroy_pedals();
+      break;
+
+    case TRACE_RELOAD_PEDAL:
+      // Only this pedal.  Keep what it had for TRACE_RECONNECT
+      if(th.length != 1 || payload[0] < 'A' || payload[0] > 'C'){
+	break;
+      }
+      trace_reload_pedal(payload[0]);
+      free_pedal_config(&reloaded);
+      reloaded = *get_pedal_config(payload[0]);
+      memset(get_pedal_config(payload[0]), 0, sizeof(reloaded));
+      break;
+
+    case TRACE_RECONNECT:
+      if(th.length != 2 || !current_pedal || *current_pedal != payload[0]){
+	break;
+      }
+      if(reconnect_pedal(payload[0], current_pedal, &reloaded,
+			 payload[1]) < 0){
+	failures++;
+	result = 1;
+      }
+      free_pedal_config(&reloaded);
+      break;
+
+    case TRACE_SWITCH: {
+      if(th.length != 2 || payload[1] < 'A' || payload[1] > 'C' ||
+	 (payload[0] != '-' && (payload[0] < 'A' || payload[0] > 'C'))){
+	break;
+      }
+      if(!fast && th.usec > trace_start){
+	int64_t wait = (int64_t)(th.usec - trace_start) -
+	  (int64_t)(now_usec() - start);
+	if(wait > 0){
+	  usleep(wait);
+	}
+      }
+      // Switch from the pedal the driver did
+      char * old_pedal = payload[0] == '-' ? NULL :
+	&pedal_names[payload[0] - 'A'];
+      current_pedal = &pedal_names[payload[1] - 'A'];
+      plan_old = old_pedal;
+      plan_new = current_pedal;
+      plan_replayed = plan_size(old_pedal, current_pedal);
+      plan_recorded = 0;
+      uint64_t a = now_usec();
+      if(change_pedal(old_pedal, current_pedal) < 0){
+	failures++;
+	result = 1;
+      }
+      replayed_usec = now_usec() - a;
+      switches++;
+      replayed_total += replayed_usec;
+      if(replayed_usec > replayed_max){
+	replayed_max = replayed_usec;
+      }
+      break;
+    }
+
+    case TRACE_PLAN:
+      src = (char *)payload + 1;
+      dst = src + strlen(src) + 1;
+      if(!plan_new || dst > (char *)payload + th.length){
+	break;
+      }
+      plan_recorded++;
+      if(!plan_has(plan_old, plan_new, payload[0], src, dst)){
+	Log("Replay: Switch %u planned %s %s -> %s.  The replay did not\n",
+	    switches, payload[0] == TRACE_OP_CONNECT ? "connect" :
+	    "disconnect", src, dst);
+	plan_mismatches++;
+      }
+      break;
+
+    case TRACE_SWITCH_DONE: {
+      int32_t r;
+      uint32_t u;
+      if(th.length != 8){
+	break;
+      }
+      if(plan_new && plan_recorded != plan_replayed){
+	Log("Replay: Switch %u planned %u steps.  The replay planned %u\n",
+	    switches, plan_recorded, plan_replayed);
+	plan_mismatches++;
+      }
+      plan_new = NULL;
+      memcpy(&r, payload, 4);
+      memcpy(&u, payload + 4, 4);
+      if(r < 0){
+	recorded_failures++;
+      }
+      recorded_total += u;
+      if(u > recorded_max){
+	recorded_max = u;
+      }
+      Log("Replay: Switch %u to %c recorded %u usec replayed %lu usec\n",
+	  switches, current_pedal ? *current_pedal : '-', u,
+	  (unsigned long)replayed_usec);
+      break;
+    }
+
+    case TRACE_JACK: {
+      int32_t r;
+      if(th.length < 9){
+	break;
+      }
+      memcpy(&r, payload + 1, 4);
+      if(payload[0] != TRACE_OP_CONNECTED && r != 0 && r != EEXIST){
+	jack_failures++;
+      }
+      break;
+    }
+
+    case TRACE_MOD_HOST:
+      // There is no mod-host behind a dummy JACK server
+      mod_host_skipped++;
+      break;
+
+    default:
+      break;
+    }
+  }
+  close(fd);
+  free_pedal_config(&reloaded);
+
+  Log("Replay: %u switches, %u pedal events. Recorded mean %lu max %lu "
+      "usec. Replayed mean %lu max %lu usec\n", switches, n_events,
+      (unsigned long)(switches ? recorded_total / switches : 0),
+      (unsigned long)recorded_max,
+      (unsigned long)(switches ? replayed_total / switches : 0),
+      (unsigned long)replayed_max);
+  Log("Replay: Failures recorded %u replayed %u.  JACK call failures "
+      "recorded %u.  mod-host commands skipped %u.  Plan mismatches %u\n",
+      recorded_failures, failures, jack_failures, mod_host_skipped,
+      plan_mismatches);
+  if(plan_mismatches){
+    result = 1;
+  }
+
+  for(unsigned i = 0; i < n_stand_ins; i++){
+    jack_client_close(stand_ins[i].client);
+  }
+  jack_client_close(CLIENT);
+  return result;
+}
+
+//+===========+++++========++++++=================
+// Press to sound latency
+//
+// The times logged for a switch are only the time spent in the JACK
+// API.  `driver -L <transitions>` measures when the new effect chain
+// can actually be heard.  The driver's JACK client stands in for the
+// sound card: every connection from a system:capture_N port is made
+// from its "probe_out" port instead, which plays a sine wave, and
+// every connection to a system:playback_N port goes to its "probe_in"
+// port.  So it works on the dummy backend.
+//
+// First each pedal is selected in turn and the signature of its
+// output (RMS and peak level of the sine after it has been through
+// the chain) is learnt.  Then random transitions are made.  For each
+// the time from the press to the first audio with the new chain's
+// signature is reported, along with how much silence and how large a
+// discontinuity (jump between samples) there was in between.
+//
+// The process callback cuts what it hears into chunks of one cycle of
+// the sine (so the RMS of a chunk is steady) and puts them in a ring
+// buffer for the main thread.  Times are in JACK frames.
+
+// The test signal
+#define PROBE_FREQUENCY 1000.0
+#define PROBE_AMPLITUDE 0.25
+
+// Quieter than this is silence
+#define PROBE_SILENCE 1e-5
+
+// Chunks in the ring buffer.  A power of two
+#define PROBE_RING 8192
+
+// How long to let a chain settle, and then listen to it, to learn its
+// signature
+#define PROBE_SETTLE_USEC 300000
+#define PROBE_LISTEN_USEC 200000
+
+// How long to listen after a transition
+#define PROBE_TRANSITION_USEC 500000
+
+// Consecutive chunks that must match the new chain
+#define PROBE_MATCH_CHUNKS 3
+
+// How far (see `probe_distance`) a chunk can be from a signature and
+// still match it
+#define PROBE_MATCH 0.25
+
+struct probe_chunk {
+  jack_nframes_t frame; // The first frame of the chunk
+  float rms;
+  float peak;
+  float jump; // Largest difference between consecutive samples
+  unsigned silent; // Samples quieter than PROBE_SILENCE
+};
+
+struct probe_signature {
+  float rms;
+  float peak;
+  float jump;
+};
+
+struct Probe {
+  jack_port_t * out;
+  jack_port_t * in;
+  double phase;
+  double phase_inc;
+  unsigned chunk_frames;
+
+  // The chunk being built.  Only touched by the process thread
+  struct probe_chunk acc;
+  double sum_sq;
+  unsigned n;
+  float last;
+
+  struct probe_chunk ring[PROBE_RING];
+  unsigned write; // Written by the process thread
+  unsigned read; // Written by the main thread
+};
+struct Probe probe;
+
+int probe_process(jack_nframes_t nframes, void * arg){
+  float * out = jack_port_get_buffer(probe.out, nframes);
+  float * in = jack_port_get_buffer(probe.in, nframes);
+  jack_nframes_t frame = jack_last_frame_time(CLIENT);
+  for(jack_nframes_t i = 0; i < nframes; i++){
+    out[i] = PROBE_AMPLITUDE * sin(probe.phase);
+    probe.phase += probe.phase_inc;
+    if(probe.phase >= 2 * M_PI){
+      probe.phase -= 2 * M_PI;
+    }
+
+    float x = in[i];
+    if(probe.n == 0){
+      memset(&probe.acc, 0, sizeof(probe.acc));
+      probe.acc.frame = frame + i;
+      probe.sum_sq = 0;
+    }
+    probe.sum_sq += x * x;
+    if(fabsf(x) > probe.acc.peak){
+      probe.acc.peak = fabsf(x);
+    }
+    if(fabsf(x - probe.last) > probe.acc.jump){
+      probe.acc.jump = fabsf(x - probe.last);
+    }
+    if(fabsf(x) < PROBE_SILENCE){
+      probe.acc.silent++;
+    }
+    probe.last = x;
+    if(++probe.n == probe.chunk_frames){
+      probe.acc.rms = sqrt(probe.sum_sq / probe.n);
+      unsigned w = __atomic_load_n(&probe.write, __ATOMIC_RELAXED);
+      probe.ring[w % PROBE_RING] = probe.acc;
+      __atomic_store_n(&probe.write, w + 1, __ATOMIC_RELEASE);
+      probe.n = 0;
+    }
+  }
+  return 0;
+}
+
+// Copy the chunks heard since the last call that start at or after
+// `from` into `chunks`.  Returns how many
+unsigned probe_collect(struct probe_chunk * chunks, unsigned max,
+		       jack_nframes_t from){
+  unsigned w = __atomic_load_n(&probe.write, __ATOMIC_ACQUIRE);
+  unsigned n = 0;
+  if(w - probe.read > PROBE_RING){
+    // Overrun.  The oldest have been overwritten
+    probe.read = w - PROBE_RING;
+  }
+  for(; probe.read != w; probe.read++){
+    struct probe_chunk * pc = &probe.ring[probe.read % PROBE_RING];
+    if((int32_t)(pc->frame - from) >= 0 && n < max){
+      chunks[n++] = *pc;
+    }
+  }
+  return n;
+}
+
+// How far a chunk is from a signature.  Zero is a perfect match
+float probe_distance(const struct probe_chunk * pc,
+		     const struct probe_signature * ps){
+  return fabsf(pc->rms - ps->rms) / fmaxf(ps->rms, 1e-3) +
+    fabsf(pc->peak - ps->peak) / fmaxf(ps->peak, 1e-3);
+}
+
+// Learn what `pedal` sounds like
+void probe_learn(char * pedal, struct probe_signature * ps){
+  static struct probe_chunk chunks[PROBE_RING];
+  usleep(PROBE_SETTLE_USEC);
+  probe_collect(chunks, 0, 0); // Discard what came before
+  usleep(PROBE_LISTEN_USEC);
+  unsigned n = probe_collect(chunks, PROBE_RING, 0);
+  memset(ps, 0, sizeof(*ps));
+  for(unsigned i = 0; i < n; i++){
+    ps->rms += chunks[i].rms;
+    ps->peak += chunks[i].peak;
+    if(chunks[i].jump > ps->jump){
+      ps->jump = chunks[i].jump;
+    }
+  }
+  if(n){
+    ps->rms /= n;
+    ps->peak /= n;
+  }
+  Log("Probe: Pedal %c RMS %.4f peak %.4f jump %.4f\n",
+      *pedal, ps->rms, ps->peak, ps->jump);
+}
+
+// Connections to and from the sound card go to the probe instead
+void probe_rewrite_ports(){
+  const char * out_name = jack_port_name(probe.out);
+  const char * in_name = jack_port_name(probe.in);
+  for(char p = 'A'; p <= 'C'; p++){
+    struct pedal_config * pc = get_pedal_config(p);
+    for(unsigned i = 0; i < pc->n_connections; i++){
+      for(unsigned j = 0; j < 2; j++){
+	char * port = pc->connections[i].ports[j];
+	const char * replace = NULL;
+	if(!strncmp(port, "system:capture_", 15)){
+	  replace = out_name;
+	}else if(!strncmp(port, "system:playback_", 16)){
+	  replace = in_name;
+	}
+	if(replace){
+	  free(port);
+	  pc->connections[i].ports[j] = strdup(replace);
+	  assert(pc->connections[i].ports[j]);
+	}
+      }
+    }
+  }
+}
+
+// Measure `n_transitions` random transitions.  Returns 0 if every
+// transition was heard
+int probe_latency(unsigned n_transitions){
+  jack_status_t status;
+  CLIENT = jack_client_open("latency", JackNoStartServer, &status);
+  if(CLIENT == NULL){
+    Log("%s:%d: jack_client_open() failed, status = 0x%x\n",
+	__FILE__, __LINE__, status);
+    return -1;
+  }
+  jack_nframes_t rate = jack_get_sample_rate(CLIENT);
+  memset(&probe, 0, sizeof(probe));
+  probe.phase_inc = 2 * M_PI * PROBE_FREQUENCY / rate;
+  probe.chunk_frames = rate / PROBE_FREQUENCY + 0.5;
+  probe.out = jack_port_register(CLIENT, "probe_out",
+				 JACK_DEFAULT_AUDIO_TYPE,
+				 JackPortIsOutput, 0);
+  probe.in = jack_port_register(CLIENT, "probe_in",
+				JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+  if(!probe.out || !probe.in ||
+     jack_set_process_callback(CLIENT, probe_process, NULL) ||
+     jack_activate(CLIENT)){
+    Log("%s:%d: Failed to set up the probe\n", __FILE__, __LINE__);
+    jack_client_close(CLIENT);
+    return -1;
+  }
+  probe_rewrite_ports();
+
+  // Switch as the driver does, so the time to wake a chain is heard
+  idle_standalone();
+
+  // Learn the signatures
+  char pedal_names[3] = {'A', 'B', 'C'};
+  struct probe_signature sig[3];
+  char * current_pedal = NULL;
+  for(unsigned i = 0; i < 3; i++){
+    idle_change_pedal(current_pedal, &pedal_names[i]);
+    current_pedal = &pedal_names[i];
+    probe_learn(current_pedal, &sig[i]);
+  }
+
+  srandom(time(NULL) ^ getpid());
+  uint64_t * latency = malloc(n_transitions * sizeof(uint64_t));
+  assert(latency);
+  unsigned heard = 0, unheard = 0, same = 0, discontinuities = 0;
+  double silence_ms = 0;
+  double frame_ms = 1000.0 / rate;
+  static struct probe_chunk chunks[PROBE_RING];
+
+  for(unsigned t = 0; t < n_transitions; t++){
+    unsigned from = *current_pedal - 'A';
+    unsigned to = (from + 1 + random() % 2) % 3;
+
+    probe_collect(chunks, 0, 0);
+    jack_nframes_t press = jack_frame_time(CLIENT);
+    if(idle_change_pedal(current_pedal, &pedal_names[to]) != 0){
+      Log("%s:%d: Switch failed\n", __FILE__, __LINE__);
+      break;
+    }
+    current_pedal = &pedal_names[to];
+    usleep(PROBE_TRANSITION_USEC);
+    unsigned n = probe_collect(chunks, PROBE_RING, press);
+
+    // When does the new chain's signature appear?
+    int distinct = probe_distance(&(struct probe_chunk){0, sig[from].rms,
+	  sig[from].peak}, &sig[to]) > 2 * PROBE_MATCH;
+    unsigned k, run = 0;
+    for(k = 0; k < n; k++){
+      if(probe_distance(&chunks[k], &sig[to]) < PROBE_MATCH &&
+	 (!distinct || probe_distance(&chunks[k], &sig[to]) <
+	  probe_distance(&chunks[k], &sig[from]))){
+	if(++run == PROBE_MATCH_CHUNKS){
+	  k -= PROBE_MATCH_CHUNKS - 1;
+	  break;
+	}
+      }else{
+	run = 0;
+      }
+    }
+
+    // Silence and the largest jump up to then
+    unsigned silent = 0;
+    float jump = 0;
+    for(unsigned i = 0; i < n && i < k + PROBE_MATCH_CHUNKS; i++){
+      silent += chunks[i].silent;
+      if(chunks[i].jump > jump){
+	jump = chunks[i].jump;
+      }
+    }
+    int discontinuity = jump > 1.5 * fmaxf(sig[from].jump, sig[to].jump) +
+      1e-3;
+    discontinuities += discontinuity;
+    silence_ms += silent * frame_ms;
+
+    if(!distinct){
+      same++;
+      Log("Probe: %c -> %c sound the same. Silent %.2f ms%s\n",
+	  'A' + from, 'A' + to, silent * frame_ms,
+	  discontinuity ? " DISCONTINUITY" : "");
+    }else if(k < n){
+      float ms = (int32_t)(chunks[k].frame - press) * frame_ms;
+      latency[heard++] = ms > 0 ? ms * 1000 : 0;
+      Log("Probe: %c -> %c heard after %.2f ms. Silent %.2f ms. "
+	  "Jump %.4f%s\n", 'A' + from, 'A' + to, ms, silent * frame_ms,
+	  jump, discontinuity ? " DISCONTINUITY" : "");
+    }else{
+      unheard++;
+      Log("Probe: %c -> %c NOT HEARD in %d ms\n", 'A' + from, 'A' + to,
+	  PROBE_TRANSITION_USEC / 1000);
+    }
+  }
+
+  // The same percentiles as the stress test
+  qsort(latency, heard, sizeof(uint64_t), compare_uint64);
+  Log("Probe: %u transitions: %u heard, %u not heard, %u between pedals "
+      "that sound the same\n", n_transitions, heard, unheard, same);
+  if(heard){
+    Log("Probe: Press to sound ms p50 %.2f p90 %.2f max %.2f\n",
+	percentile(latency, heard, 50) / 1000.0,
+	percentile(latency, heard, 90) / 1000.0,
+	latency[heard - 1] / 1000.0);
+  }
+  Log("Probe: Silence %.2f ms in all. %u discontinuities\n",
+      silence_ms, discontinuities);
+  free(latency);
+  idle_restore();
+  jack_client_close(CLIENT);
+  return unheard ? 1 : 0;
+}
+
+// Write a record of the pedal in a known location so other
+// programmes can know what pedal is selected.  Returns 0 on success
+int record_pedal(char * current_pedal){
+  int fd_pedal;
+  char file_name[PATH_MAX];
+  assert(snprintf(file_name, PATH_MAX, "%s/PEDALS/.PEDAL", home_dir) < PATH_MAX);
+  fd_pedal = open(file_name, O_WRONLY); // File must exist
+  if(fd_pedal < 0) {
+    Log("%s:%d: Failed to open %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    return -1;
+  }
+
+  // Programmes using this file must get a lock to read it.  
+  if(!fcntl(fd_pedal, F_SETLK, F_WRLCK)){
+    Log("%s:%d: Failed to lock %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    return -1;
+  }
+	
+  if(dprintf(fd_pedal,
+	     "%c", current_pedal ? *current_pedal : ' ') <= 0){
+    Log("%s:%d: Failed to write to %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    return -1;
+  }
+
+  if(close(fd_pedal) < 0){
+    Log("%s:%d: Failed to close %s. Error %s\n",
+	__FILE__, __LINE__, file_name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Select `new_pedal`.  The footswitch and the control API come here.
+// Returns what `idle_change_pedal` does
+int select_pedal(char ** current_pedal, char * new_pedal){
+  char * old_pedal = *current_pedal;
+  *current_pedal = new_pedal;
+  if(new_pedal){
+    journal_pedal(*new_pedal);
+  }
+  return idle_change_pedal(old_pedal, new_pedal);
+}
+
+// Reread all the pedal files (and .CONTROLS).  On SIGHUP, and when the
+// control API loads a bank
+void reload_pedals(char * current_pedal, uint64_t * mod_host_lost){
+  destroy_pedals();
+  initialise_pedals();
+  journal_links();
+  destroy_controls();
+  initialise_controls();
+  if(!*mod_host_lost && declared_effects()){
+    // Only what changed in the edited pedals goes to mod-host.  Wake
+    // the selected pedal's effects first, so the connections inside
+    // its board can be made
+    if((current_pedal && idle_wake(*current_pedal) < 0) ||
+       reconcile(current_pedal ? *current_pedal : '\0', 0) < 0){
+      *mod_host_lost = now_usec();
+    }else{
+      // Effects may have been added again
+      idle_forget();
+      if(idle_change_pedal(NULL, current_pedal) < 0){
+	exit(-1);
+      }
+    }
+  }else if(!*mod_host_lost && current_pedal){
+    // The effects each pedal uses may have changed
+    idle_apply(*current_pedal);
+  }
+}
+
+// Reread the file for pedal `p`.  Unlike `reload_pedals` the other
+// pedals, and the connections `p` still has, are left alone.  Returns
+// 0, or -1 if a connection could not be made or broken
+int reload_pedal(char p, char * current_pedal, uint64_t * mod_host_lost){
+  struct pedal_config * pc = get_pedal_config(p);
+  struct pedal_config old = *pc;
+  trace_reload_pedal(p);
+  memset(pc, 0, sizeof(*pc));
+  load_pedal(p);
+  free_pedal_config(&boards);
+  load_boards();
+  if(!*mod_host_lost && declared_effects()){
+    if(reconcile('\0', 0) < 0){
+      *mod_host_lost = now_usec();
+    }else{
+      idle_forget();
+    }
+  }
+
+  int r = 0;
+  if(current_pedal && *current_pedal == p){
+    if(!*mod_host_lost && idle_wake(p) < 0){
+      *mod_host_lost = now_usec();
+    }
+    // If mod-host is lost the new configuration is connected when it
+    // is back
+    r = reconnect_pedal(p, current_pedal, &old, !*mod_host_lost);
+  }
+  if(current_pedal && !*mod_host_lost){
+    idle_apply(*current_pedal);
+  }
+  free_pedal_config(&old);
+  return r;
+}
+
+// The selected pedal `p` has been reread.  Connect what its file has
+// now (if `connect`) and break what `old`, what it had before, had
+// that the new one does not.  Replaying a trace comes here too.
+// Returns 0, or -1 if a connection could not be made or broken
+int reconnect_pedal(char p, char * current_pedal, struct pedal_config * old,
+		    int connect){
+  struct pedal_config * pc = get_pedal_config(p);
+  int r = 0;
+  trace_reconnect(p, connect);
+  if(connect){
+    r = implement_pedal(current_pedal);
+  }
+  for(unsigned i = 0; r == 0 && i < old->n_connections; i++){
+    const char * src = old->connections[i].ports[0];
+    const char * dst = old->connections[i].ports[1];
+    if(!src || !dst || pedal_has(pc, src, dst) || !connected(src, dst)){
+      continue;
+    }
+    uint64_t t = now_usec();
+    int e = jack_disconnect(CLIENT, src, dst);
+    trace_jack(TRACE_OP_DISCONNECT, e, t, src, dst);
+    if(e != 0 && connected(src, dst)){
+      Log("%s:%d: FAILURE Pedal: %c %s -> %s jack_disconnect: %d\n",
+	  __FILE__, __LINE__, p, src, dst, e);
+      r = -1;
+    }
+  }
+  return r;
+}
+
+//+===========+++++========++++++=================
+// Control API
+//
+// The driver listens on a Unix socket, .driver.sock next to
+// .driver.pid.  A client sends requests, one per line, and gets one
+// line back for each: "ok ..." or "error <why>".
+//
+//   select <pedal>       Select pedal A, B, or C as if it was pressed.
+//                        ok <pedal> <usec the switch took, waking
+//                        its effects included>
+//   bank <file> ...      Link PEDALS/A (then B, then C) to the files
+//                        in PEDALS and reread the pedals.  One round
+//                        trip where the front end used to run ln(1)
+//                        and kill -HUP (which both still work)
+//   reload <pedal>       Reread one pedal's file
+//   state                ok pedal=<A|B|C|-> A=<file> B=<file> C=<file>
+//                        mod-host=<up|lost>
+//   stats                ok switches=<n> failures=<n> last=<usec>
+//                        mean=<usec> max=<usec> hot=<n> warm=<n>
+//                        cold=<n> load=<DSP load %>
+//
+// The driver runs without a footswitch plugged in, so benchmarks can
+// drive it with `select`
+
+#define API_SOCKET ".driver.sock"
+#define MAX_API_CLIENTS 8
+
+struct api_client {
+  int fd; // -1 if not in use
+
+  // A partially read request
+  char line[1024];
+  unsigned len;
+};
+
+struct Api {
+  int fd; // Listening.  -1 if there is no API
+  struct api_client clients[MAX_API_CLIENTS];
+};
+struct Api api = {-1};
+
+// What `select` points `current_pedal` at
+char api_pedals[3] = {'A', 'B', 'C'};
+
+// Listen on the socket.  Returns 0, or -1 if there is no API
+int initialise_api(){
+  for(unsigned i = 0; i < MAX_API_CLIENTS; i++){
+    api.clients[i].fd = -1;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+	      home_dir, API_SOCKET) >= sizeof(addr.sun_path)){
+    Log("%s:%d: %s/%s is too long for a socket.  No control API\n",
+	__FILE__, __LINE__, home_dir, API_SOCKET);
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0){
+    Log("%s:%d: socket Error %s\n", __FILE__, __LINE__, strerror(errno));
+    return -1;
+  }
+  // Left behind by the last driver
+  unlink(addr.sun_path);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(fd, MAX_API_CLIENTS) < 0 ||
+     fcntl(fd, F_SETFL, O_NONBLOCK) < 0){
+    Log("%s:%d: Failed to listen on %s. Error %s\n",
+	__FILE__, __LINE__, addr.sun_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  api.fd = fd;
+  return 0;
+}
+
+// Add the API's sockets to `rfds`.  Returns the largest fd
+int api_fds(fd_set * rfds, int max_fd){
+  if(api.fd < 0){
+    return max_fd;
+  }
+  FD_SET(api.fd, rfds);
+  if(api.fd > max_fd){
+    max_fd = api.fd;
+  }
+  for(unsigned i = 0; i < MAX_API_CLIENTS; i++){
+    if(api.clients[i].fd >= 0){
+      FD_SET(api.clients[i].fd, rfds);
+      if(api.clients[i].fd > max_fd){
+	max_fd = api.clients[i].fd;
+      }
+    }
+  }
+  return max_fd;
+}
+
+void api_close(struct api_client * ac){
+  close(ac->fd);
+  ac->fd = -1;
+  ac->len = 0;
+}
+
+void api_respond(struct api_client * ac, const char * fmt, ...){
+  char buf[1024];
+  va_list argptr;
+  va_start(argptr, fmt);
+  int n = vsnprintf(buf, sizeof(buf) - 1, fmt, argptr);
+  va_end(argptr);
+  if(n > sizeof(buf) - 2){
+    n = sizeof(buf) - 2;
+  }
+  buf[n++] = '\n';
+  // The client is non-blocking.  One that is not reading its
+  // responses is dropped rather than stall the driver
+  if(send(ac->fd, buf, n, MSG_NOSIGNAL) != n){
+    if(errno == EAGAIN || errno == EWOULDBLOCK){
+      Log("%s:%d: Control API client not reading.  Dropped\n",
+	  __FILE__, __LINE__);
+    }
+    api_close(ac);
+  }
+}
+
+// The pedal named in a request, or NULL
+char * api_pedal(const char * name){
+  if(name[0] >= 'A' && name[0] <= 'C' && name[1] == '\0'){
+    return &api_pedals[name[0] - 'A'];
+  }
+  return NULL;
+}
+
+// Point PEDALS/`pedal` at `file` in PEDALS.  Done with a rename so the
+// link is never missing.  Returns 0 on success
+int api_link(char pedal, const char * file){
+  char target[PATH_MAX], link_name[PATH_MAX], tmp_name[PATH_MAX];
+  assert(snprintf(target, PATH_MAX, "%s/PEDALS/%s",
+		  home_dir, file) < PATH_MAX);
+  assert(snprintf(link_name, PATH_MAX, "%s/PEDALS/%c",
+		  home_dir, pedal) < PATH_MAX);
+  assert(snprintf(tmp_name, PATH_MAX, "%s/PEDALS/.%c.tmp",
+		  home_dir, pedal) < PATH_MAX);
+  unlink(tmp_name);
+  if(symlink(target, tmp_name) < 0 || rename(tmp_name, link_name) < 0){
+    Log("%s:%d: Failed to link %s to %s. Error %s\n",
+	__FILE__, __LINE__, link_name, target, strerror(errno));
+    unlink(tmp_name);
+    return -1;
+  }
+  return 0;
+}
+
+// What PEDALS/`pedal` links to, without the directory
+const char * api_link_target(char pedal, char * buf, unsigned size){
+  char link_name[PATH_MAX];
+  assert(snprintf(link_name, PATH_MAX, "%s/PEDALS/%c",
+		  home_dir, pedal) < PATH_MAX);
+  int n = readlink(link_name, buf, size - 1);
+  if(n < 0){
+    return "-";
+  }
+  buf[n] = '\0';
+  const char * slash = strrchr(buf, '/');
+  return slash ? slash + 1 : buf;
+}
+
+void api_request(struct api_client * ac, char ** current_pedal,
+		 uint64_t * mod_host_lost){
+  char * words[5];
+  unsigned n_words = 0;
+  for(char * w = strtok(ac->line, " \t\r"); w && n_words < 5;
+      w = strtok(NULL, " \t\r")){
+    words[n_words++] = w;
+  }
+  if(n_words == 0){
+    api_respond(ac, "error Empty request");
+    return;
+  }
+
+  if(!strcmp(words[0], "select") && n_words == 2){
+    char * pedal = api_pedal(words[1]);
+    if(!pedal){
+      api_respond(ac, "error No pedal %s", words[1]);
+      return;
+    }
+    int r = select_pedal(current_pedal, pedal);
+    if(r < 0){
+      // Bail out after an error, as for the footswitch
+      exit(-1);
+    }
+    record_pedal(*current_pedal);
+    if(r > 0){
+      api_respond(ac, "error mod-host lost.  %c is connected when it "
+		  "is back", *pedal);
+    }else{
+      api_respond(ac, "ok %c %lu", *pedal,
+		  (unsigned long)(idle.wake_usec + switch_stats.last_usec));
+    }
+
+  }else if(!strcmp(words[0], "bank") && n_words >= 2 && n_words <= 4){
+    // Check every file before changing any link
+    for(unsigned i = 1; i < n_words; i++){
+      char file_name[PATH_MAX];
+      struct stat sb;
+      assert(snprintf(file_name, PATH_MAX, "%s/PEDALS/%s",
+		      home_dir, words[i]) < PATH_MAX);
+      if(strchr(words[i], '/') || words[i][0] == '.' ||
+	 stat(file_name, &sb) < 0 || !S_ISREG(sb.st_mode)){
+	api_respond(ac, "error No pedal file %s", words[i]);
+	return;
+      }
+    }
+    for(unsigned i = 1; i < n_words; i++){
+      if(api_link('A' + i - 1, words[i]) < 0){
+	api_respond(ac, "error Cannot link %c", 'A' + i - 1);
+	return;
+      }
+    }
+    reload_pedals(*current_pedal, mod_host_lost);
+    api_respond(ac, "ok");
+
+  }else if(!strcmp(words[0], "reload") && n_words == 2){
+    char * pedal = api_pedal(words[1]);
+    if(!pedal){
+      api_respond(ac, "error No pedal %s", words[1]);
+      return;
+    }
+    // `load_pedal` insists on a file.  The link may be missing or
+    // dangling
+    char file_name[PATH_MAX];
+    struct stat sb;
+    assert(snprintf(file_name, PATH_MAX, "%s/PEDALS/%c",
+		    home_dir, *pedal) < PATH_MAX);
+    if(stat(file_name, &sb) < 0 || !S_ISREG(sb.st_mode)){
+      api_respond(ac, "error No pedal file for %c", *pedal);
+      return;
+    }
+    if(reload_pedal(*pedal, *current_pedal, mod_host_lost) < 0){
+      exit(-1);
+    }
+    api_respond(ac, "ok");
+
+  }else if(!strcmp(words[0], "state") && n_words == 1){
+    char a[PATH_MAX], b[PATH_MAX], c[PATH_MAX];
+    api_respond(ac, "ok pedal=%c A=%s B=%s C=%s mod-host=%s",
+		*current_pedal ? **current_pedal : '-',
+		api_link_target('A', a, PATH_MAX),
+		api_link_target('B', b, PATH_MAX),
+		api_link_target('C', c, PATH_MAX),
+		*mod_host_lost ? "lost" : "up");
+
+  }else if(!strcmp(words[0], "stats") && n_words == 1){
+    unsigned count[4] = {0, 0, 0, 0};
+    for(unsigned i = 0; i < idle.n_effects; i++){
+      count[idle.effects[i].state]++;
+    }
+    struct SwitchStats * ss = &switch_stats;
+    api_respond(ac, "ok switches=%u failures=%u last=%lu mean=%lu max=%lu "
+		"hot=%u warm=%u cold=%u load=%.1f",
+		ss->switches, ss->failures, (unsigned long)ss->last_usec,
+		(unsigned long)(ss->switches ?
+				ss->total_usec / ss->switches : 0),
+		(unsigned long)ss->max_usec, count[IDLE_HOT],
+		count[IDLE_WARM], count[IDLE_COLD], jack_cpu_load(CLIENT));
+
+  }else{
+    api_respond(ac, "error Not understood: %s", words[0]);
+  }
+}
+
+// Accept connections and answer requests that are waiting
+void api_poll(fd_set * rfds, char ** current_pedal,
+	      uint64_t * mod_host_lost){
+  if(api.fd < 0){
+    return;
+  }
+  if(FD_ISSET(api.fd, rfds)){
+    int fd = accept(api.fd, NULL, NULL);
+    if(fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) < 0){
+      Log("%s:%d: fcntl Error %s\n", __FILE__, __LINE__, strerror(errno));
+      close(fd);
+      fd = -1;
+    }
+    unsigned i;
+    for(i = 0; fd >= 0 && i < MAX_API_CLIENTS; i++){
+      if(api.clients[i].fd < 0){
+	api.clients[i].fd = fd;
+	api.clients[i].len = 0;
+	break;
+      }
+    }
+    if(fd >= 0 && i == MAX_API_CLIENTS){
+      Log("%s:%d: Too many control API clients\n", __FILE__, __LINE__);
+      close(fd);
+    }
+  }
+  for(unsigned i = 0; i < MAX_API_CLIENTS; i++){
+    struct api_client * ac = &api.clients[i];
+    if(ac->fd < 0 || !FD_ISSET(ac->fd, rfds)){
+      continue;
+    }
+    char buf[256];
+    int n = read(ac->fd, buf, sizeof(buf));
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      continue;
+    }
+    if(n <= 0){
+      api_close(ac);
+      continue;
+    }
+    for(int j = 0; j < n && ac->fd >= 0; j++){
+      if(buf[j] != '\n'){
+	if(ac->len < sizeof(ac->line) - 1){
+	  ac->line[ac->len++] = buf[j];
+	}
+	continue;
+      }
+      ac->line[ac->len] = '\0';
+      ac->len = 0;
+      api_request(ac, current_pedal, mod_host_lost);
+    }
+  }
+}
+
+int main(int argc, char * argv[]) {
+
+  // Defined in jack.h(?)
+  jack_status_t status;
+
+  unsigned buff_size = 1023;
+  char buf[buff_size + 1];
+
+  fd_set rfds;
+  struct timeval tv;
+
+  int retval, res;
+  unsigned yalv;//, last_yalv;
+  uint8_t key_b[KEY_MAX/8 + 1];
+  char * mi_root;
+
+  struct sigaction act;
+  memset (&act, 0, sizeof (act));
+  act.sa_handler = signal_handler;
+  act.sa_flags = SA_RESTART | SA_NODEFER;
+  if (sigaction (SIGHUP, &act, NULL) < 0) {
+    perror ("sigaction");
+    exit (-1);
+  }
+
+
+  mi_root = getenv("PATH_MI_ROOT");
+  if(!mi_root){
+    mi_root = "/home/patch/ModHostPedal";
+  }
+  assert(snprintf(home_dir, PATH_MAX, "%s", mi_root) <= PATH_MAX);
+  if(chdir(home_dir)){
+    // FIXME An error message
+    assert(0);
+  }
+
+  // Command line options select a test mode.  With no options the
+  // driver runs normally
+  int opt;
+  unsigned stress_switches = 0;
+  int stress_mutate = 0;
+  const char * replay_fn = NULL;
+  int replay_fast = 0;
+  unsigned probe_transitions = 0;
+  while((opt = getopt(argc, argv, "s:mt:P:fL:I")) != -1){
+    switch(opt){
+    case 's':
+      stress_switches = atoi(optarg);
+      break;
+    case 'm':
+      stress_mutate = 1;
+      break;
+    case 't':
+      if(trace_open(optarg) < 0){
+	exit(-1);
+      }
+      break;
+    case 'P':
+      replay_fn = optarg;
+      break;
+    case 'f':
+      replay_fast = 1;
+      break;
+    case 'L':
+      probe_transitions = atoi(optarg);
+      break;
+    case 'I':
+      // Leave idle effects running
+      idle.enabled = 0;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-I] [-t <trace>] [-s <switches> [-m] | "
+	      "-P <trace> [-f] | -L <transitions>]\n", argv[0]);
+      exit(-1);
+    }
+  }
+  if(replay_fn){
+    return replay_trace(replay_fn, replay_fast);
+  }
+  if(stress_switches){
+    initialise_pedals();
+    return stress(stress_switches, stress_mutate);
+  }
+  if(probe_transitions){
+    initialise_pedals();
+    return probe_latency(probe_transitions);
+  }
+
+  // The journal of the rig's state.  Loaded before the pedals so
+  // missing links in PEDALS can be put back
+  int replay = initialise_journal();
+
+  // Initialise the definitions of pedals
+  // Signal with HUP to change
+  initialise_pedals();
+  journal_links();
+
+  // Expression pedals.  Also reread on HUP
+  initialise_controls();
+  
+  pid_t pid = getpid();
+  int fd_pid = open(".driver.pid", O_WRONLY|O_CREAT, 0644);
+  if(fd_pid < 0){
+    Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno));
+    exit(fd_pid);
+  }
+  
+  // Lock the file because the front end used this to communicate with
+  // this programme.  
+  if(!fcntl(fd_pid, F_SETLK, F_WRLCK)){
+    Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno));
+    exit(-1);
+  }
+
+  int pid_res = dprintf(fd_pid, "%d", pid);
+
+  if(close(fd_pid) < 0){
+    Log("%s:%d: Error %s\n", __FILE__, __LINE__, strerror(errno));
+    return -1;
+  }	
+
+  Log( "Wrote pid: %d. Error: %s\n", pid, strerror(errno));
+  assert(pid_res > 0);
+
+  
+
+  /* Set up the client for jack */
+  CLIENT = jack_client_open ("client_name", JackNullOption, &status);
+  if (CLIENT == NULL) {
+    fprintf (stderr, "jack_client_open() failed, "
+	     "status = 0x%2.0x\n", status);
+    if (status & JackServerFailed) {
+      fprintf (stderr, "Unable to connect to JACK server\n");
+    }
+    exit (1);
+  }
+
+  trace_jack_callbacks();
+
+  // The keyboard/pedal.  Without it pedals can only be selected with
+  // the control API
+  int fd = get_foot_pedal_fd("1a86","e026");
+  if(fd < 0){
+    Log("%s:%d: No foot pedal\n", __FILE__, __LINE__);
+  }
+#ifdef EVIOCSCLOCKID
+  // Time stamp the pedal's events with the clock the trace uses
+  int clock_id = CLOCK_MONOTONIC;
+  if(fd >= 0 && trace.fd >= 0 && ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0){
+    Log("%s:%d: EVIOCSCLOCKID Error %s\n",
+	__FILE__, __LINE__, strerror(errno));
+  }
+#endif
+  
+  unsigned last_yalv = 0;
+
+  char * current_pedal = NULL;
+  char A = 'A', B = 'B', C = 'C';
+
+  // Hold a connection to mod-host.  If it drops mod-host has died and
+  // the rig is reconciled when it is back
+  uint64_t mod_host_lost = 0;
+  if(mod_hosts_connect() < 0){
+    mod_host_lost = now_usec();
+  }else if(replay || declared_effects()){
+    if(reconcile(rig.pedal, 1) < 0){
+      mod_host_lost = now_usec();
+    }
+  }
+  if(replay && rig.pedal){
+    // Back to the pedal that was selected
+    current_pedal = rig.pedal == 'A' ? &A : rig.pedal == 'B' ? &B : &C;
+    if(idle_change_pedal(NULL, current_pedal) < 0){
+      exit(-1);
+    }
+    if(record_pedal(current_pedal) < 0){
+      return -1;
+    }
+  }
+
+  // Requests from the front end and benchmarks
+  initialise_api();
+
+#ifdef PROFILE
+  int loop_limit = 0;
+#endif
+  Log("Starting main loop\n");
+  while(RUNNING == 1){
+#ifdef PROFILE
+    if(loop_limit++ > 12){
+      RUNNING = 0;
+    }
+#endif
+    // A command that failed drops its connection
+    for(unsigned i = 0; !mod_host_lost && i < n_mod_hosts; i++){
+      if(mod_hosts[i].fd < 0){
+	mod_host_lost = now_usec();
+      }
+    }
+    if(mod_host_lost &&
+       now_usec() - mod_host_lost >= MOD_HOST_TIMEOUT_USEC){
+      // Try to get mod-host back
+      if(mod_hosts_connect() == 0 &&
+	 reconcile(current_pedal ? *current_pedal : '\0', 1) == 0){
+	Log("%s:%d: mod-host is back\n", __FILE__, __LINE__);
+	mod_host_lost = 0;
+	idle_forget();
+	if(idle_change_pedal(NULL, current_pedal) < 0){
+	  exit(-1);
+	}
+      }else{
+	mod_host_lost = now_usec();
+      }
+    }
+
+    // Wake up in time to send expression pedal values
+    long control_wait = mod_host_lost ? -1 : flush_controls();
+    if(mod_host_lost && (control_wait < 0 ||
+			 control_wait > MOD_HOST_TIMEOUT_USEC)){
+      control_wait = MOD_HOST_TIMEOUT_USEC;
+    }
+
+    // And to report the DSP load idle effects saved
+    long idle_wait = idle_report();
+    if(idle_wait >= 0 && (control_wait < 0 || idle_wait < control_wait)){
+      control_wait = idle_wait;
+    }
+    if(control_wait < 0 && journal.appended > JOURNAL_COMPACT_BYTES){
+      // Compact if this is quiet
+      tv.tv_sec = JOURNAL_COMPACT_IDLE_USEC / 1000000;
+      tv.tv_usec = JOURNAL_COMPACT_IDLE_USEC % 1000000;
+    }else if(control_wait < 0){
+      tv.tv_sec = 200;
+      tv.tv_usec = 0;
+    }else{
+      tv.tv_sec = control_wait / 1000000;
+      tv.tv_usec = control_wait % 1000000;
+    }
+    FD_ZERO(&rfds);
+    int max_fd = -1;
+    if(fd >= 0){
+      FD_SET(fd, &rfds);
+      max_fd = fd;
+    }
+    max_fd = api_fds(&rfds, max_fd);
+    for(unsigned i = 0; i < controls.n_sources; i++){
+      if(controls.sources[i].fd < 0){
+	// Dropped
+	continue;
+      }
+      FD_SET(controls.sources[i].fd, &rfds);
+      if(controls.sources[i].fd > max_fd){
+	max_fd = controls.sources[i].fd;
+      }
+    }
+    for(unsigned i = 0; i < n_mod_hosts; i++){
+      if(mod_hosts[i].fd >= 0){
+	FD_SET(mod_hosts[i].fd, &rfds);
+	if(mod_hosts[i].fd > max_fd){
+	  max_fd = mod_hosts[i].fd;
+	}
+      }
+    }
+    retval = select(max_fd+1, &rfds, NULL, NULL, &tv);
+
+    if(retval < 0){
+      Log("select Error %s\n", strerror(errno));
+
+      // TODO: What is this constant: 4?
+      if(errno == 4){
+	
+	// Interupted by a signal
+	Log( "%s:%d: signaled: %d\n",
+	     __FILE__, __LINE__, signaled);
+	if(signaled){
+	  fprintf(stderr, "signaled\n");
+	  reload_pedals(current_pedal, &mod_host_lost);
+	}
+	signaled = 0;
+	continue;
+      }
+      return -1;
+    }else if(retval == 0){
+#ifdef VERBOSE
+      if(control_wait < 0){
+	Log("Heartbeat...");
+      }
+#endif
+      // Nothing has happened for JOURNAL_COMPACT_IDLE_USEC and
+      // nothing is waiting to be sent.  A good time to compact
+      if(control_wait < 0 && journal.appended > JOURNAL_COMPACT_BYTES){
+	journal_compact();
+      }
+      continue;
+    }
+
+    // Expression pedals and mod-host responses
+    for(unsigned i = 0; i < controls.n_sources; i++){
+      if(controls.sources[i].fd >= 0 &&
+	 FD_ISSET(controls.sources[i].fd, &rfds)){
+	read_control_source(i);
+      }
+    }
+    for(unsigned i = 0; i < n_mod_hosts; i++){
+      if(mod_hosts[i].fd >= 0 && FD_ISSET(mod_hosts[i].fd, &rfds)){
+	int r = mod_host_read(&mod_hosts[i]);
+	if(r > 0){
+	  send_controls();
+	}else if(r < 0){
+	  mod_host_lost = now_usec();
+	}
+      }
+    }
+    api_poll(&rfds, &current_pedal, &mod_host_lost);
+    if(fd < 0 || !FD_ISSET(fd, &rfds)){
+      continue;
+    }
+
+    // Read the keyboard
+    memset(key_b, 0, sizeof(key_b));
+    if(ioctl(fd, EVIOCGKEY(sizeof(key_b)), key_b) == -1){
+      printf("IOCTL Error %s\n", strerror(errno));
+      return -1;
+    }
+    /* Log( "IOCTL returnes\n"); */
+    
+    for (yalv = 0; yalv < KEY_MAX; yalv++) {
+      if (test_bit(yalv, key_b)) {
+	/* the bit is set in the key state */
+	if(last_yalv != yalv){
+	  /* Only when it changes */
+	  char * new_pedal = current_pedal;
+
+	  if(yalv == 0x1e){
+	    new_pedal = &A;
+	  }else if(yalv == 0x30){
+	    new_pedal = &B;
+	  }else if(yalv == 0x2e){
+	    new_pedal = &C;
+	  }	    
+	  last_yalv = yalv;
+	  if(select_pedal(&current_pedal, new_pedal) < 0){
+	    // Bail out after an error
+	    exit(-1);
+	  }
+	}
+
+	if(record_pedal(current_pedal) < 0){
+	  return -1;
+	}
+      }
+    }
+
+    /* Consume what can be read from fd */
     res = read(fd, &buf, buff_size);
     if(res < 0){
       printf("Read error: %s\n", strerror(errno));
@@ -686,6 +4752,10 @@ int main(int argc, char * argv[]) {
     }else if(res == 0){
       printf("Nothing to read\n");
     }      
+    for(int i = 0; i + sizeof(struct input_event) <= res;
+	i += sizeof(struct input_event)){
+      trace_evdev((struct input_event *)(buf + i));
+    }
     /* printf("That was a pedal\n"); */
   }
   Log( "After main loop.  RUNNING: %d\n", RUNNING);
@@ -715,7 +4785,7 @@ void Log(char * sp, ...){
   }
 
 
-  int res = dprintf(fd, LOGBUFFER);
+  int res = dprintf(fd, "%s", LOGBUFFER);
   if(res != strlen(LOGBUFFER)){
     fprintf(stderr, "%s:%d: Failed to write log %s d: %d fd: %d Message: %s\n",
 	    __FILE__, __LINE__, strerror(errno), res, fd, LOGBUFFER);
@@ -727,7 +4797,14 @@ void Log(char * sp, ...){
 	    __FILE__, __LINE__, strerror(errno));
     exit(-1);
   }
-  fprintf(stderr, LOGBUFFER);
+  fprintf(stderr, "%s", LOGBUFFER);
+}
+
+// Micro seconds on the monotonic clock
+uint64_t now_usec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 void print_connections() {
@@ -777,18 +4854,39 @@ void print_pedal(char pedal){
 void initialise_pedals(){
   pedals.pedal_configA.n_connections = 0;
   pedals.pedal_configA.connections = NULL;
+  pedals.pedal_configA.n_internal = 0;
+  pedals.pedal_configA.internal = NULL;
+  pedals.pedal_configA.n_effects = 0;
+  pedals.pedal_configA.effects = NULL;
+  pedals.pedal_configA.mod_host_port = 0;
   pedals.pedal_configB.n_connections = 0;
   pedals.pedal_configB.connections = NULL;
+  pedals.pedal_configB.n_internal = 0;
+  pedals.pedal_configB.internal = NULL;
+  pedals.pedal_configB.n_effects = 0;
+  pedals.pedal_configB.effects = NULL;
+  pedals.pedal_configB.mod_host_port = 0;
   pedals.pedal_configC.n_connections = 0;
   pedals.pedal_configC.connections = NULL;
+  pedals.pedal_configC.n_internal = 0;
+  pedals.pedal_configC.internal = NULL;
+  pedals.pedal_configC.n_effects = 0;
+  pedals.pedal_configC.effects = NULL;
+  pedals.pedal_configC.mod_host_port = 0;
   load_pedal('A');
   load_pedal('B');
   load_pedal('C');
+  load_boards();
 }
 
 
 void _destroy_pedal(struct pedal_config * pc){
   clear_jack();
+  free_pedal_config(pc);
+}
+
+// Free what is in a pedal configuration
+void free_pedal_config(struct pedal_config * pc){
   if(  pc->n_connections > 0) {
     for(unsigned i = 0; i < pc->n_connections; i++){
       free_connection(&pc->connections[i]);
@@ -803,12 +4901,28 @@ void _destroy_pedal(struct pedal_config * pc){
     pc->connections= NULL;
     pc->n_connections = 0;
   }
+  for(unsigned i = 0; i < pc->n_internal; i++){
+    free_connection(&pc->internal[i]);
+  }
+  free(pc->internal);
+  pc->internal = NULL;
+  pc->n_internal = 0;
+  for(unsigned i = 0; i < pc->n_effects; i++){
+    free(pc->effects[i].uri);
+    free(pc->effects[i].params);
+  }
+  free(pc->effects);
+  pc->effects = NULL;
+  pc->n_effects = 0;
+  pc->mod_host_port = 0;
 }
 
 void destroy_pedals() {
+  trace_reload();
   _destroy_pedal(&pedals.pedal_configA);
   _destroy_pedal(&pedals.pedal_configB);
   _destroy_pedal(&pedals.pedal_configC);  
+  free_pedal_config(&boards);
 }
 
 void free_connection(struct jack_connection  * jc){
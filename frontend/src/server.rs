@@ -15,13 +15,15 @@ use std::env;
 use std::fs;
 use std::fs::File;
 use std::io::Read;
+use std::io::Write;
 use std::io::{self, BufRead};
 #[cfg(unix)]
 use std::os::unix::io::{AsRawFd, RawFd};
+#[cfg(unix)]
+use std::os::unix::net::UnixStream;
 #[cfg(target_os = "wasi")]
 use std::os::wasi::io::{AsRawFd, RawFd};
 use std::path::Path;
-use std::process;
 use std::sync::mpsc;
 use std::sync::Arc;
 use std::sync::Mutex;
@@ -478,87 +480,37 @@ fn set_instrument(name: &str) {
 
     // The pedal board is implemented by links in the PEDALS directory
     // pointing at files that have the instructions to configure the
-    // JACK pipes to implement the pedal
-    let mut link_letter = 'A';
+    // JACK pipes to implement the pedal.  The driver makes the links
+    // and reads the new pedal layout when asked to load the bank
     match list.get(&name.to_string()) {
         Some(vec_names) => {
-            for name in vec_names {
-                let mut process = process::Command::new("/bin/ln")
-                    .arg("-s")
-                    .arg("-f")
-                    .arg(format!("{}/{}", get_dir(), name.as_str()).as_str())
-                    .arg(format!("{}/{}", get_dir(), &link_letter).as_str())
-                    .stdout(process::Stdio::piped())
-                    .stderr(process::Stdio::piped())
-                    .spawn()
-                    .expect("Failed");
-                let mut stdout = process.stdout.take().unwrap();
-                let mut stderr = process.stderr.take().unwrap();
-                let mut output: Vec<u8> = Vec::new();
-                let mut errput: Vec<u8> = Vec::new();
-                stdout.read_to_end(&mut output).unwrap();
-                stderr.read_to_end(&mut errput).unwrap();
-                let ecode =
-                    process.wait().expect("failed to wait on link process");
-                let res = ecode.success();
-                info!("set link {} ->  {}  Res: {}", &link_letter, name, res);
-                info!(
-                    "set link output: {}",
-                    String::from_utf8(output).unwrap()
-                );
-                info!(
-                    "set link errput: {}",
-                    String::from_utf8(errput).unwrap()
-                );
-                assert!(res);
-                link_letter = (link_letter as u8 + 1) as char;
-            }
-            // Signal the driver so it reads the new pedal layout
-            let file =
-                File::open(format!("{}/../.driver.pid", get_dir()).as_str())
-                    .unwrap();
-            nix::fcntl::flock(file.as_raw_fd(), FlockArg::LockExclusive)
-                .unwrap();
-
-            let driver_pid: u64 = io::BufReader::new(file)
-                .lines()
-                .next()
-                .unwrap()
-                .unwrap()
-                .parse()
-                .unwrap();
-
-            let mut process = process::Command::new("/bin/kill")
-                .arg(format!("{}", driver_pid).as_str())
-                .arg("-HUP")
-                .stdout(process::Stdio::piped())
-                .stderr(process::Stdio::piped())
-                .spawn()
-                .expect("Failed");
-            let mut stdout = process.stdout.take().unwrap();
-            let mut stderr = process.stderr.take().unwrap();
-            let mut output: Vec<u8> = Vec::new();
-            let mut errput: Vec<u8> = Vec::new();
-            stdout.read_to_end(&mut output).unwrap();
-            stderr.read_to_end(&mut errput).unwrap();
-            let ecode = process.wait().expect("failed to wait signal driver");
-            let res = ecode.success();
-            info!("kill -HUP {}", driver_pid);
-            info!(
-                "signal driver output: {}",
-                String::from_utf8(output).unwrap()
-            );
-            info!(
-                "signal driver errput: {}",
-                String::from_utf8(errput).unwrap()
-            );
-            assert!(res);
+            let request = format!("bank {}\n", vec_names.join(" "));
+            match driver_request(request.as_str()) {
+                Ok(response) => info!("set_instrument: {}", response),
+                Err(err) => eprintln!("set_instrument {}: {}", name, err),
+            };
         }
         None => eprintln!("Cannot find pedal bank names {}", name),
     };
     info!("set_instrument done");
 }
 
+/// Send one request to the driver over its control socket and return
+/// the response.  A response that is not "ok ..." is an error
+fn driver_request(request: &str) -> io::Result<String> {
+    let mut stream =
+        UnixStream::connect(format!("{}/../.driver.sock", get_dir()))?;
+    stream.write_all(request.as_bytes())?;
+    let mut response = String::new();
+    io::BufReader::new(stream).read_line(&mut response)?;
+    let response = response.trim_end().to_string();
+    if response.starts_with("ok") {
+        Ok(response)
+    } else {
+        Err(io::Error::new(io::ErrorKind::Other, response))
+    }
+}
+
 fn send_message(
     server_msg: shared::ServerMessage,
     out: &ws::Sender,
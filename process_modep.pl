@@ -4,6 +4,18 @@ use strict;
 # For temporary files to transfer commands to `control`
 use File::Temp qw/tmpnam/;
 
+# To ask mod-host for the DSP load
+use IO::Socket;
+
+## With -g only write the pedal files.  Nothing is put into mod-host
+## and no DSP cost is measured.  The driver reconciles mod-host with
+## the files when it starts
+my $GENERATE_ONLY = 0;
+if(@ARGV and $ARGV[0] eq '-g'){
+    shift;
+    $GENERATE_ONLY = 1;
+}
+
 my $VERBOSE = shift;
 defined $VERBOSE or $VERBOSE  = 0;
 
@@ -389,6 +401,72 @@ foreach my $name ( sort keys %pedal_settings){
 #     print "\n";
 # }
 
+## Boards are shared out between MOD_HOST_SHARDS mod-hosts (one per
+## core, see `EffectsStart`).  Shard N listens on 5555 + 2N.  They
+## are balanced by DSP cost: how much JACK's DSP load rose when the
+## board was last loaded, kept in .dsp_cost.  The cost of a board not
+## measured yet is guessed from the number of effects in it
+my $SHARDS = $ENV{MOD_HOST_SHARDS} || 1;
+my $BASE_PORT = 5555;
+
+## Guess at the cost of one effect, in percent of JACK's cycle
+my $EFFECT_COST = 2;
+
+my $cost_fn = "$PATH_MI_ROOT/.dsp_cost";
+my %dsp_cost = ();
+if(open(my $in, $cost_fn)){
+    while(my $line = <$in>){
+	$line =~ /^(\S+)\s+([0-9.]+)\s*$/ and $dsp_cost{$1} = $2;
+    }
+}
+
+sub board_cost( $ ) {
+    my $name = shift or die;
+    defined($dsp_cost{$name}) and return $dsp_cost{$name};
+    return $EFFECT_COST *
+	scalar(grep {/^mh add /} @{$control_commands{$name}});
+}
+
+## Heaviest board first, each to the least loaded shard
+my @shard_load = map {0} (1..$SHARDS);
+my %board_port = ();
+foreach my $name (sort {&board_cost($b) <=> &board_cost($a) or
+			    $a cmp $b} keys %control_commands){
+    my $shard = 0;
+    foreach my $s (1..$SHARDS - 1){
+	$shard_load[$s] < $shard_load[$shard] and $shard = $s;
+    }
+    $shard_load[$shard] += &board_cost($name);
+    $board_port{$name} = $BASE_PORT + 2 * $shard;
+    $VERBOSE and print STDERR "$name -> shard $shard (".
+	&board_cost($name).")\n";
+}
+
+## JACK's DSP load (percent) from the mod-host on the passed port.
+## Averaged as it jumps about.  undef if mod-host cannot say.  The
+## load is JACK's, for the whole server, not for that mod-host.  The
+## boards are loaded one at a time, so the rise is still the cost of
+## the board just loaded
+sub cpu_load( $ ) {
+    my $port = shift or die;
+    my $sock = new IO::Socket::INET( PeerAddr => 'localhost',
+				     PeerPort => $port,
+				     Proto => 'tcp') or return undef;
+    my $total = 0;
+    my $n = 10;
+    foreach (1..$n){
+	print $sock "cpu_load\n";
+	my ($result, $c) = ('', '');
+	while(read($sock, $c, 1) and ord($c) != 0){
+	    $result .= $c;
+	}
+	$result =~ /^resp\s+0\s+([0-9.]+)/ or return undef;
+	$total += $1;
+	select(undef, undef, undef, 0.05);
+    }
+    return $total / $n;
+}
+
 my $pedal_dir = "$PATH_MI_ROOT/PEDALS";
 
 -d $pedal_dir or mkdir $pedal_dir or die "$!: Cannot mkdir $pedal_dir";
@@ -406,25 +484,54 @@ foreach my $file (@files){
 
 foreach my $name (sort keys %control_commands){
     
-    ## Loop over each effect and set it up in `mod-host` using `control`
-    
-    # print STDERR  "Setting up $name pedal\n";
-    my $cmds = join("\n", @{$control_commands{$name}})."\n";
-    my ($now, $tmpFn) = tmpnam() or die $!;
-    print $now $cmds;
-    # print STDERR  $cmds;
-    seek($now, 0, 0);
-
-    my @res = `$PATH_MI_ROOT/control $tmpFn`;
+    my $port = $board_port{$name};
+    my @res = ();
+    if(!$GENERATE_ONLY){
+	## Loop over each effect and set it up in `mod-host` using `control`
+
+	# print STDERR  "Setting up $name pedal\n";
+	my $cmds = join("\n", @{$control_commands{$name}})."\n";
+	my ($now, $tmpFn) = tmpnam() or die $!;
+	print $now $cmds;
+	# print STDERR  $cmds;
+	seek($now, 0, 0);
+
+	my $before = &cpu_load($port);
+	@res = `MOD_HOST_PORT=$port $PATH_MI_ROOT/control $tmpFn`;
+	my $after = &cpu_load($port);
+	if(defined($before) and defined($after)){
+	    $dsp_cost{$name} = $after > $before ? $after - $before : 0;
+	}
+    }
     # print STDERR  "Finished with control \$? $?\n";
     my $_name = "$pedal_dir/$name";
     if(! grep {/FAIL/} @res ){
 	# print STDERR "\$_name: $_name\n";
 	open(my $pedal, ">$_name") or die "$!: $_name";
-	print $pedal join("\n", @{$pedal_commands{$name}})."\n";
+
+	## Which mod-host the effects are in, the effects (so the
+	## driver can reconcile mod-host with the pedals), the
+	## connections between effects, then to and from the system.
+	## The connections between effects keep their `jack` prefix:
+	## they are made once, when the effects are set up, and
+	## selecting a pedal does not touch them
+	my @lines = ("mod-host $port");
+	foreach my $c (@{$control_commands{$name}}){
+	    $c =~ /^mh (.+)$/ and push(@lines, $1);
+	    $c =~ /^jack / and push(@lines, $c);
+	}
+	push(@lines, @{$pedal_commands{$name}});
+	print $pedal join("\n", @lines)."\n";
     }else{
 	print STDERR join("\n", @res)."\n";
 	unlink $_name;
     }
     # print STDERR "Name done: $name\n";
 }
+
+## Remember what each board cost for next time
+if(open(my $out, ">$cost_fn")){
+    foreach my $name (sort keys %dsp_cost){
+	print $out "$name $dsp_cost{$name}\n";
+    }
+}